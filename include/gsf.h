@@ -36,15 +36,38 @@ extern "C" {
 /*
  * A type representing an emulator capable of playing GSF files.
  * It's usually the first parameter to library functions.
+ * libgsf keeps no unsynchronized state shared between emulators, so that
+ * different emulators can be used from different threads at the same time,
+ * as long as mGBA's cores don't share any state either: libgsf relies on
+ * that, but can't guarantee it.
+ * A single emulator must only be used by one thread at a time; debug builds
+ * of the library assert on that when loading, playing and seeking.
  */
 typedef struct GsfEmu GsfEmu;
 
 /* Flags passed to gsf_new, see below. */
 typedef enum GsfFlags {
-    GSF_INFO_ONLY   = 1 << 1,
-    GSF_MULTI       = 1 << 2,
+    GSF_INFO_ONLY        = 1 << 1,
+    GSF_MULTI            = 1 << 2,
+    GSF_RESAMPLER_NATIVE = 1 << 3,
+    GSF_RESAMPLER_SINC   = 1 << 4,
 } GsfFlags;
 
+/*
+ * The voices of the GBA's sound hardware: the four PSG channels and the two
+ * Direct Sound FIFOs. Used for muting and soloing, and as the order of the
+ * channels when playing with GSF_MULTI.
+ */
+typedef enum GsfChannel {
+    GSF_CHANNEL_SQUARE1,
+    GSF_CHANNEL_SQUARE2,
+    GSF_CHANNEL_WAVE,
+    GSF_CHANNEL_NOISE,
+    GSF_CHANNEL_FIFO_A,
+    GSF_CHANNEL_FIFO_B,
+    GSF_CHANNEL_COUNT,
+} GsfChannel;
+
 /* A type representing the tags inside a GSF file. Returned by gsf_get_tags, see below. */
 typedef struct GsfTags {
     const char *title;
@@ -56,8 +79,8 @@ typedef struct GsfTags {
     const char *copyright;
     const char *gsfby;
     /*
-     * The following two tags (volume and fade) are completely ignored by the library,
-     * but we include them for the sake of completeness.
+     * The following two tags (volume and fade) are only applied to the output
+     * when asked to, see gsf_set_tag_volume and gsf_set_fade.
      */
     double volume;
     int fade;
@@ -90,6 +113,7 @@ typedef enum GsfErrorCode {
     GSF_INVALID_CRC,
     GSF_UNCOMPRESS_ERROR,
     GSF_SEEK_OUT_OF_BOUNDS,
+    GSF_INVALID_ARGUMENT,
 } GsfErrorCode;
 
 /* Where errors can come from, see below. */
@@ -134,6 +158,57 @@ typedef struct GsfReader {
     void *userdata;
 } GsfReader;
 
+/*
+ * A reader that can also read parts of a file, used by
+ * gsf_load_file_with_range_reader. The `read_range` function may be NULL; if
+ * not, it reads at most `size` bytes starting at `offset`, returning less
+ * data if the file is shorter, and its data is deleted with
+ * `reader.delete_data`. It is used when only parts of a file are needed,
+ * such as when loading with GSF_INFO_ONLY. The readers libgsf ships with
+ * (see below) always read ranges when they can, whichever function they
+ * are passed to.
+ */
+typedef struct GsfRangeReader {
+    GsfReader reader;
+    GsfReadResult (*read_range)(const char *filename, long offset, long size, void *userdata,
+        const GsfAllocators *allocators);
+} GsfRangeReader;
+
+/*
+ * A file held in memory, used by gsf_load_memory. If `free` is set, libgsf
+ * takes ownership of `data` and calls `free` (with `userdata` and the
+ * allocators passed to the loading function) once it's done with it, even
+ * when loading fails. Otherwise `data` stays owned by the caller and only
+ * has to be valid until the loading function returns.
+ */
+typedef struct GsfBuffer {
+    unsigned char *data;
+    long size;
+    void (*free)(unsigned char *data, long size, void *userdata, const GsfAllocators *allocators);
+    void *userdata;
+} GsfBuffer;
+
+/*
+ * Finds library files for gsf_load_memory. `resolve` is called with a
+ * library's name, as written in the _lib tags, and should fill `out` with its
+ * data. On failure it should return an error, leaving `out` untouched.
+ */
+typedef struct GsfLibResolver {
+    GsfError (*resolve)(const char *name, GsfBuffer *out, void *userdata);
+    void *userdata;
+} GsfLibResolver;
+
+/*
+ * These return the readers libgsf ships with. The stdio reader reads files
+ * into memory allocated with the given allocators. The mmap reader maps files
+ * read-only instead, which avoids a copy; it is only available on POSIX
+ * systems when libgsf is built with USE_MMAP, otherwise the stdio reader is
+ * returned. The functions that don't take a reader use the mmap reader if
+ * it's available.
+ */
+GSF_API GsfReader gsf_stdio_reader(void);
+GSF_API GsfReader gsf_mmap_reader(void);
+
 /*
  * These two functions get and check the library version, respectively.
  * They can be used to test if you've got any installation errors.
@@ -147,9 +222,24 @@ GSF_API bool gsf_is_compatible_version(void);
  * - GSF_INFO_ONLY: creates an emulator used only for retrieving tags and
  *   other info. If an emulator has been created with this option set, then
  *   gsf_play and gsf_seek will return immediately (anything else works
- *   as normally).
- * - GSF_MULTI: creates an emulator that will output audio on multiple
- *   channels instead of a single one. (this flag is still unsupported)
+ *   as normally). Loading a file only reads its header and tags: the
+ *   program section isn't checked nor uncompressed, and libraries aren't
+ *   loaded at all.
+ * - GSF_MULTI: creates an emulator that outputs each voice of the GBA
+ *   separately instead of the final mix: gsf_play writes 12 interleaved
+ *   channels, a left/right pair for each voice in GsfChannel order. All
+ *   stems come from the same emulation pass, and summing them gives back
+ *   the stereo mix (give or take rounding and clipping).
+ * - GSF_RESAMPLER_NATIVE: outputs audio at the GBA's native rate of 32768 Hz,
+ *   ignoring `frequency`. This skips resampling, which makes it the cheapest
+ *   option; gsf_sample_rate then returns 32768.
+ * - GSF_RESAMPLER_SINC: renders audio at the native rate, then resamples it
+ *   to `frequency` with a windowed-sinc filter. Costs more CPU time than the
+ *   default, but leaves much less aliasing above 16 kHz, which makes it the
+ *   best choice for rendering to files. Ignored if GSF_RESAMPLER_NATIVE is
+ *   also given.
+ * Without either resampler flag, blip_buf resamples straight from the GBA's
+ * clock to `frequency`, which is cheap and sounds fine for playback.
  * `gsf_new_with_allocators` behaves the same as `gsf_new`, but takes a
  * parameter `allocators` that the functions will use to allocate memory.
  */
@@ -161,11 +251,44 @@ GSF_API GsfError gsf_new_with_allocators(GsfEmu **out, int sample_rate, int flag
 GSF_API void gsf_delete(GsfEmu *emu);
 GSF_API void gsf_delete_with_allocators(GsfEmu *emu, GsfAllocators *allocators);
 
+/*
+ * Unloads the loaded file, freeing its memory. The emulator keeps its
+ * settings and can load another file, which is much cheaper than creating a
+ * new emulator. Loading a file into an emulator that already has one loaded
+ * unloads the old one first, so this is only needed to free memory early.
+ * Until another file is loaded, gsf_play outputs silence.
+ */
+GSF_API void gsf_unload(GsfEmu *emu);
+
+/*
+ * A pool of emulators ready to be used, for programs that go through many
+ * short-lived emulators, such as servers creating one per request. Creating
+ * an emulator sets up a whole GBA core, which takes much longer than loading
+ * a file into one that exists already.
+ * `gsf_pool_new` creates a pool of `size` emulators, all created right away
+ * with `sample_rate` and `flags` (see gsf_new). `gsf_pool_acquire` takes an
+ * emulator from the pool, creating a new one if the pool is empty.
+ * `gsf_pool_release` unloads an emulator, puts its settings back to their
+ * defaults and returns it to the pool, or deletes it if the pool already
+ * holds `size` emulators. Emulators must be released to the pool they came
+ * from; those still in the pool are deleted by `gsf_pool_delete`, which uses
+ * the allocators the pool was created with.
+ * Pools are safe to use from multiple threads.
+ */
+typedef struct GsfEmuPool GsfEmuPool;
+
+GSF_API GsfError gsf_pool_new(GsfEmuPool **out, int sample_rate, int flags, size_t size);
+GSF_API GsfError gsf_pool_new_with_allocators(GsfEmuPool **out, int sample_rate, int flags,
+    size_t size, GsfAllocators *allocators);
+GSF_API void gsf_pool_delete(GsfEmuPool *pool);
+GSF_API GsfError gsf_pool_acquire(GsfEmuPool *pool, GsfEmu **out);
+GSF_API void gsf_pool_release(GsfEmuPool *pool, GsfEmu *emu);
+
 /*
  * Loads a file and any corresponding library files inside an emulator.
  * `filename` is assumed to be a valid file path.
- * The other three functions lets you specify a `reader` (i.e. how to read
- * a file) and `allocators` (how to allocate memory).
+ * The other functions let you specify a `reader` (i.e. how to read a file),
+ * possibly one that reads ranges, and `allocators` (how to allocate memory).
  */
 GSF_API GsfError gsf_load_file(GsfEmu *emu, const char *filename);
 GSF_API GsfError gsf_load_file_with_reader(GsfEmu *emu, const char *filename,
@@ -174,21 +297,250 @@ GSF_API GsfError gsf_load_file_with_allocators(GsfEmu *emu,
     const char *filename, GsfAllocators *allocators);
 GSF_API GsfError gsf_load_file_with_reader_allocators(GsfEmu *emu,
     const char *filename, GsfReader *reader, GsfAllocators *allocators);
+GSF_API GsfError gsf_load_file_with_range_reader(GsfEmu *emu, const char *filename,
+    GsfRangeReader *reader);
+GSF_API GsfError gsf_load_file_with_range_reader_allocators(GsfEmu *emu,
+    const char *filename, GsfRangeReader *reader, GsfAllocators *allocators);
+
+/*
+ * Like gsf_load_file, but loads a file that's already in memory. The file
+ * and its libraries are parsed in place, without copying them. Libraries are
+ * looked up with `resolver`, which may be NULL if the file has none.
+ * Libraries loaded this way are kept in the library cache too, recognized by
+ * their name and CRC.
+ */
+GSF_API GsfError gsf_load_memory(GsfEmu *emu, GsfBuffer file, const GsfLibResolver *resolver);
+GSF_API GsfError gsf_load_memory_with_allocators(GsfEmu *emu, GsfBuffer file,
+    const GsfLibResolver *resolver, GsfAllocators *allocators);
+
+/*
+ * Sets the maximum size of the library cache, in bytes. Libraries (the files
+ * named by _lib tags) are usually shared by many files, so once parsed they
+ * are kept in memory and shared by all emulators, evicting the least recently
+ * used ones when the cache gets full. Libraries read with the default reader
+ * are recognized by their path and modification time, those read with a
+ * custom reader by their path and CRC.
+ * On Linux, cached libraries are also shared by the emulators playing them:
+ * each maps the library copy-on-write rather than copying it, so only the
+ * pages a file patches take memory of their own.
+ * The cache is safe to use from multiple threads and always uses the default
+ * allocators. A size of 0 disables it. The default size is 64 MiB.
+ * `gsf_clear_lib_cache` empties the cache.
+ */
+GSF_API void gsf_set_lib_cache_size(size_t max_bytes);
+GSF_API void gsf_clear_lib_cache(void);
+
+/*
+ * Sets a directory where uncompressed libraries are kept, so that other
+ * processes, and later runs, map them from there rather than uncompressing
+ * them again. Processes mapping the same library share its memory. Libraries
+ * are stored under the CRC of their compressed data, each in a file written
+ * under a temporary name and renamed once complete, so that the directory
+ * can be shared by processes running at the same time. Once the directory
+ * holds more than `max_bytes`, the least recently used files are deleted.
+ * Each file also holds the CRC of the uncompressed library, which each
+ * process checks the first time it uses the file; files that don't match
+ * are deleted and the library is uncompressed again. The directory is
+ * created if needed. NULL stops using it (its files stay).
+ * Returns false if the directory couldn't be created, or if this build of
+ * the library can't share roms (see gsf_set_lib_cache_size); there's no disk
+ * cache by default.
+ */
+GSF_API bool gsf_set_rom_cache_dir(const char *path, size_t max_bytes);
+
+/*
+ * Most sound drivers spend their time in a loop waiting for VBlank. mGBA can
+ * skip such a loop, jumping straight to the next event, once it knows its
+ * address. libgsf asks mGBA to detect it automatically, which works for most
+ * drivers.
+ * `gsf_set_idle_loop_override` sets the idle loop address of every rom with
+ * the given 4-character `game_code` (as found at offset 0xAC of the rom),
+ * overriding detection. A negative `address` disables the optimization for
+ * that game instead; a NULL `game_code` is ignored. Overrides are shared by
+ * all emulators and apply to files loaded after setting them;
+ * `gsf_clear_idle_loop_overrides` removes them all.
+ * `gsf_get_idle_loop` returns whether an idle loop is known for the loaded
+ * file, writing its address to `address` if it's not NULL. Since detection
+ * happens while playing, this may only become true after some playback.
+ */
+GSF_API void gsf_set_idle_loop_override(const char *game_code, long address);
+GSF_API void gsf_clear_idle_loop_overrides(void);
+GSF_API bool gsf_get_idle_loop(const GsfEmu *emu, unsigned long *address);
 
 /* Checks if any files are loaded inside an emulator. */
 GSF_API bool gsf_loaded(const GsfEmu *emu);
 
 /*
- * Generates `size` 16-bit signed stereo samples inside out from an emulator.
- * Generates them in one single channel (I.E. no need to do any mixing).
+ * Generates `size` 16-bit signed samples inside out from an emulator.
+ * Samples are interleaved, with gsf_num_channels channels per frame: stereo,
+ * unless GSF_MULTI was used.
  * Note that there is no need to zero out `out`, since the function must
  * do that anyway.
  */
 GSF_API void gsf_play(GsfEmu *emu, short *out, long size);
 
+/*
+ * Same as gsf_play, but for other sample formats, saving callers from
+ * converting samples themselves. Samples are 32-bit floats in [-1, 1).
+ * - gsf_play_f32 generates `size` interleaved samples, like gsf_play.
+ * - gsf_play_planar_f32 generates `frames` samples for each channel, each
+ *   channel into its own buffer: `out` must point to gsf_num_channels buffers.
+ * - gsf_play_mono_f32 generates `frames` samples of a mono downmix (the
+ *   average of left and right; with GSF_MULTI, of all the stems summed up).
+ * In all cases, the emulator moves forward by as many frames as generated.
+ * Planar and mono output always starts at a frame boundary: if an earlier
+ * gsf_play, gsf_play_f32 or seek stopped in the middle of a frame, the rest
+ * of that frame is skipped first.
+ */
+GSF_API void gsf_play_f32(GsfEmu *emu, float *out, long size);
+GSF_API void gsf_play_planar_f32(GsfEmu *emu, float *const *out, long frames);
+GSF_API void gsf_play_mono_f32(GsfEmu *emu, float *out, long frames);
+
+/* How many cycles the emulated GBA runs for each second of audio. */
+#define GSF_CYCLES_PER_SECOND 16777216
+
+/*
+ * Like gsf_play, but for callers that can't block for long, like real-time
+ * audio threads: emulates for about `cycles` cycles at most, then returns how
+ * many samples it wrote to `out`. Fewer than `size` means the budget ran out
+ * or the file ended (see gsf_ended); the rest of `out` is left untouched, and
+ * the next call carries on from there. Samples already emulated are written
+ * whatever the budget. Emulation stops at the first point past the budget
+ * where it can, usually within a few hundred cycles.
+ * GSF_CYCLES_PER_SECOND cycles make one second of audio; how long they take
+ * depends on the machine and the file (gsf_bench play measures it). Seek
+ * snapshots are still taken on the way and aren't counted in the budget; turn
+ * them off with gsf_set_seek_snapshots where that matters.
+ *
+ * gsf_play_cost estimates how many cycles the next `size` samples take to
+ * emulate, not counting samples already emulated, so that hosts can decide
+ * when and where to emulate them. Samples are emulated in blocks of about
+ * 2048 frames, so the cost of a smaller request is often 0 or a whole block.
+ * It's 0 once the file has ended.
+ */
+GSF_API long gsf_play_budgeted(GsfEmu *emu, short *out, long size, long cycles);
+GSF_API long gsf_play_cost(const GsfEmu *emu, long size);
+
+/*
+ * A player emulates on a thread of its own, ahead of time, into a ring
+ * buffer, so that real-time hosts only copy samples out of it from their
+ * audio callback: gsf_player_read never blocks, takes no locks and never
+ * allocates. Only one thread may call gsf_player_read at a time.
+ * `gsf_player_new` starts playing `emu` from where it is; it returns
+ * GSF_INVALID_ARGUMENT if `emu` was created with GSF_INFO_ONLY or has no file
+ * loaded. The player then owns the emulator until `gsf_player_delete`, which
+ * stops the thread (and uses the allocators the player was created with); in
+ * between, the emulator must not be used directly. `options` may be NULL for
+ * the defaults:
+ * - `latency` is how many frames the buffer holds (default: 8192). The more,
+ *   the longer emulation can stall before the reader runs out, and the
+ *   longer seeks take to be heard.
+ * - `chunk` is how many frames are emulated at a time (default: a quarter of
+ *   `latency`). The buffer is topped up once that much of it is free, so it
+ *   normally holds between `latency - chunk` and `latency` frames.
+ * `gsf_player_read` copies up to `size` samples to `out` and returns how
+ * many it copied, filling the rest with silence. Running out before the end
+ * of the file counts as an underrun.
+ * `gsf_player_seek` asks the player to seek; it returns right away, and the
+ * samples from the new position follow what was read until the seek is
+ * done. What was buffered before is dropped. Seeks that fail (see gsf_seek)
+ * are ignored. `gsf_player_tell` returns the position of the next sample
+ * gsf_player_read returns, which lags behind the emulator by the latency.
+ * `gsf_player_ended` checks if the file ended and everything was read.
+ * These, and `gsf_player_get_stats`, are safe to call from any thread.
+ */
+typedef struct GsfPlayer GsfPlayer;
+
+typedef struct GsfPlayerOptions {
+    long latency;
+    long chunk;
+} GsfPlayerOptions;
+
+typedef struct GsfPlayerStats {
+    unsigned long underruns;        /* reads that ran out of samples */
+    unsigned long underrun_samples; /* samples of silence those got */
+    unsigned long dropped_samples;  /* samples skipped by seeks */
+    long buffered;                  /* samples ready to be read */
+} GsfPlayerStats;
+
+GSF_API GsfError gsf_player_new(GsfPlayer **out, GsfEmu *emu, const GsfPlayerOptions *options);
+GSF_API GsfError gsf_player_new_with_allocators(GsfPlayer **out, GsfEmu *emu,
+    const GsfPlayerOptions *options, GsfAllocators *allocators);
+GSF_API void gsf_player_delete(GsfPlayer *player);
+GSF_API long gsf_player_read(GsfPlayer *player, short *out, long size);
+GSF_API void gsf_player_seek(GsfPlayer *player, long millis);
+GSF_API void gsf_player_seek_samples(GsfPlayer *player, long samples);
+GSF_API long gsf_player_tell(const GsfPlayer *player);
+GSF_API long gsf_player_tell_samples(const GsfPlayer *player);
+GSF_API bool gsf_player_ended(const GsfPlayer *player);
+GSF_API void gsf_player_get_stats(const GsfPlayer *player, GsfPlayerStats *out);
+
+/*
+ * Counters about what an emulator has done. Those about loading cover the
+ * last call to one of the gsf_load functions, libraries included; libraries
+ * found in the library cache aren't read, parsed or uncompressed again. The
+ * others count from when the file was loaded.
+ * Times are in milliseconds. `cycles` are GBA clock cycles, `frames` are
+ * video frames (the GBA draws 59.73 of them per second), and
+ * `samples_skipped` are samples emulated to seek and thrown away.
+ * gsf_get_stats must not be called while the emulator is in use on another
+ * thread.
+ */
+typedef struct GsfStats {
+    unsigned long long bytes_read;
+    unsigned long long bytes_inflated;
+    double read_ms;
+    double parse_ms;
+    double inflate_ms;
+    double impose_ms;
+    double setup_ms;
+    unsigned long long cycles;
+    unsigned long long frames;
+    unsigned long long samples_played;
+    unsigned long long samples_skipped;
+} GsfStats;
+
+GSF_API void gsf_get_stats(const GsfEmu *emu, GsfStats *out);
+
+/*
+ * The phases the library reports to trace hooks. Phases may nest: seeking
+ * emulates, and emulating mixes samples and takes seek snapshots.
+ */
+typedef enum GsfTracePhase {
+    GSF_TRACE_READ,         /* reading a file */
+    GSF_TRACE_PARSE,        /* parsing a file's header and tags */
+    GSF_TRACE_INFLATE,      /* uncompressing a rom and checking its CRC */
+    GSF_TRACE_IMPOSE,       /* copying roms into the final rom image */
+    GSF_TRACE_SETUP,        /* loading the rom image into the core */
+    GSF_TRACE_EMULATE,      /* running the core until it has samples */
+    GSF_TRACE_MIX,          /* reading samples out of blip_buf and resampling */
+    GSF_TRACE_SEEK,
+    GSF_TRACE_SNAPSHOT,     /* taking a seek snapshot */
+    GSF_TRACE_PHASE_COUNT,
+} GsfTracePhase;
+
+/*
+ * Hooks called at the beginning and at the end of each phase, on the thread
+ * running it, e.g. to feed a tracer or a profiler. Either may be NULL.
+ * The hooks are only called by builds of the library with tracing enabled
+ * (the ENABLE_TRACING CMake option); other builds leave them out entirely,
+ * and gsf_set_trace_hooks returns false.
+ * The hooks apply to every emulator, and must be set (or removed, with NULL)
+ * while no emulator is in use.
+ */
+typedef struct GsfTraceHooks {
+    void (*begin)(GsfTracePhase phase, void *userdata);
+    void (*end)(GsfTracePhase phase, void *userdata);
+    void *userdata;
+} GsfTraceHooks;
+
+GSF_API bool gsf_set_trace_hooks(const GsfTraceHooks *hooks);
+
 /* Checks if an emulator has finished playing a loaded file.
  * Functionally equivalent to:
  *     `!gsf_infinite(emu) && gsf_tell(emu) >= gsf_length(emu)`
+ * unless a fade was set with gsf_set_fade, in which case the file ends after
+ * the fade.
  */
 GSF_API bool gsf_ended(const GsfEmu *emu);
 
@@ -223,13 +575,40 @@ GSF_API long gsf_tell_samples(const GsfEmu *emu);
 
 /*
  * Sets the currently playing file to a specified position in milliseconds or
- * in samples. Note that seeking backwards can be slow.
+ * in samples. Seeking backwards restarts emulation from the closest snapshot
+ * taken while playing (see gsf_set_seek_snapshots below), or from the start
+ * of the file if there's none, so it can still be slow.
  * Guaranteed to return the error GSF_SEEK_OUT_OF_BOUNDS if the seek position
  * is out of bounds.
  */
 GSF_API GsfError gsf_seek(GsfEmu *emu, long millis);
 GSF_API GsfError gsf_seek_samples(GsfEmu *emu, long samples);
 
+/*
+ * Configures the snapshots used for seeking. While playing, the emulator saves
+ * its state every `interval` milliseconds, so that seeking backwards only has
+ * to emulate from the closest snapshot. `max_bytes` limits the memory used by
+ * snapshots: when it's reached, every other snapshot is dropped and the
+ * interval is doubled. An interval of 0 disables snapshots.
+ * By default, snapshots are taken every 10 seconds and use up to 16 MiB.
+ */
+GSF_API void gsf_set_seek_snapshots(GsfEmu *emu, long interval, size_t max_bytes);
+
+/*
+ * Enables or disables fast seeking. When seeking forward, the emulator must
+ * emulate everything up to the seek position, but the audio it generates
+ * is thrown away. With fast seeking, audio is sampled less often while doing
+ * so, going back to normal shortly before the seek position, which makes
+ * seeking faster. Positions are always exact, but the samples played after
+ * a fast seek can differ slightly from those of a straight render: blip_buf
+ * rounds as it integrates, so sampling less often can leave it off by a
+ * fraction of a sample, which shows up as differences of a sample value or
+ * two. Only enable it where that doesn't matter, e.g. when a user scrubs
+ * through a track.
+ * Fast seeking is disabled by default.
+ */
+GSF_API void gsf_set_fast_seek(GsfEmu *emu, bool enabled);
+
 /*
  * Gets and sets the default length when parsing a file.
  * Ideally, this length should be set before loading a file (it won't modify
@@ -250,6 +629,32 @@ GSF_API void gsf_set_default_length(GsfEmu *emu, long length);
 GSF_API bool gsf_infinite(GsfEmu *emu);
 GSF_API void gsf_set_infinite(GsfEmu *emu, bool infinite);
 
+/*
+ * Fade curves for gsf_set_fade. GSF_FADE_LOG fades out linearly in decibels
+ * (down to -60 dB, then to silence), which sounds more even than a linear
+ * fade.
+ */
+typedef enum GsfFade {
+    GSF_FADE_NONE,
+    GSF_FADE_LINEAR,
+    GSF_FADE_LOG,
+} GsfFade;
+
+/*
+ * Sets how to fade out at the end of a file. Unless `fade` is GSF_FADE_NONE
+ * (the default), playback goes on for the length of the fade tag after the
+ * length, fading out sample by sample, and only ends after that. gsf_length
+ * doesn't include the fade. Nothing fades out while playing infinitely.
+ */
+GSF_API void gsf_set_fade(GsfEmu *emu, GsfFade fade);
+
+/*
+ * Whether to scale the output by the volume tag. Off by default. Samples
+ * that end up out of range get clipped in gsf_play, but not in the float
+ * variants.
+ */
+GSF_API void gsf_set_tag_volume(GsfEmu *emu, bool enabled);
+
 /* Returns the sample rate set at creation. */
 GSF_API int gsf_sample_rate(GsfEmu *emu);
 
@@ -259,6 +664,93 @@ GSF_API int gsf_sample_rate(GsfEmu *emu);
  */
 GSF_API int gsf_num_channels(GsfEmu *emu);
 
+/*
+ * Mutes and solos voices, where `channel` is a GsfChannel. A voice plays if
+ * it isn't muted and either no voice is soloed or it is one of the soloed
+ * ones. This applies to both the stereo mix and GSF_MULTI stems, and stays
+ * in effect across loads and seeks.
+ */
+GSF_API void gsf_mute_channel(GsfEmu *emu, int channel, bool mute);
+GSF_API void gsf_solo_channel(GsfEmu *emu, int channel, bool solo);
+
+/*
+ * A file to render with gsf_render, see below. `write` is called with each
+ * block of samples rendered, `size` 16-bit samples interleaved like with
+ * gsf_play, and may return false to stop rendering the file early. `done` is
+ * called once the file is finished, whether rendering succeeded or not.
+ * Either may be NULL. Both get `userdata` and are called from the thread that
+ * rendered the file.
+ * gsf_render fills in `error`, set if the file couldn't be loaded or no
+ * emulator could be created for it, and `samples`, the number of samples
+ * rendered, before calling `done`.
+ */
+typedef struct GsfRenderJob {
+    const char *filename;
+    bool (*write)(const short *samples, long size, void *userdata);
+    void (*done)(const struct GsfRenderJob *job, void *userdata);
+    void *userdata;
+    GsfError error;
+    long samples;
+} GsfRenderJob;
+
+/*
+ * Options for gsf_render. `sample_rate` and `flags` are the ones given to
+ * gsf_new (GSF_INFO_ONLY makes no sense here). `threads` is the number of
+ * threads to render on, 0 meaning one per core. `default_length` is passed to
+ * gsf_set_default_length unless it's 0. If `length` isn't 0, every file is
+ * rendered for that many milliseconds instead of its own length, which is
+ * how to render a looping file for a set time. `fade` and `tag_volume` are
+ * passed to gsf_set_fade and gsf_set_tag_volume.
+ */
+typedef struct GsfRenderOptions {
+    int sample_rate;
+    int flags;
+    int threads;
+    long default_length;
+    long length;
+    GsfFade fade;
+    bool tag_volume;
+} GsfRenderOptions;
+
+/*
+ * Renders `count` files from start to end (including the fade, if asked to)
+ * on a pool of threads, returning once all of them are done. Each thread
+ * creates one emulator and reuses it for every file it renders, and takes
+ * files from the other threads when it runs out, so that long and short files
+ * spread evenly. Files are rendered with seek snapshots disabled, since
+ * nothing seeks. Errors are reported in each job; the returned error is the
+ * first one met creating an emulator, if any.
+ */
+GSF_API GsfError gsf_render(GsfRenderJob *jobs, size_t count, const GsfRenderOptions *options);
+GSF_API GsfError gsf_render_with_allocators(GsfRenderJob *jobs, size_t count,
+    const GsfRenderOptions *options, GsfAllocators *allocators);
+
+/*
+ * Renders a single file like gsf_render, but splits it into segments that
+ * are rendered in parallel, which helps with long files. Only output
+ * resampled with GSF_RESAMPLER_SINC can be split: `options->flags` must be
+ * exactly GSF_RESAMPLER_SINC, or GSF_INVALID_ARGUMENT is returned. A first
+ * pass emulates the whole file once on a single thread, skipping the sinc
+ * filtering, which takes most of the time, and saves the emulator's state
+ * every `segment_length` milliseconds (0 picks a length from the file's
+ * length and the number of threads). The segments are then rendered from
+ * those states on a pool of threads, and handed to `write` in order, from
+ * whichever thread finishes the segment allowing it; calls never overlap.
+ * The output is meant to be the same as rendering the file in one go.
+ * Other output can't be split this way: the first pass would have to run
+ * blip_buf (and the GSF_MULTI stems) too, costing as much as the render
+ * itself. To render many files quickly, pass them all to gsf_render instead.
+ * As a check that the output is the same, each segment is rendered a little
+ * into the next one; if `mismatches` isn't NULL, it receives the number of
+ * segments that didn't start with those samples, which should be 0.
+ * Returns the same error as the one set in `job`.
+ */
+GSF_API GsfError gsf_render_segmented(GsfRenderJob *job, const GsfRenderOptions *options,
+    long segment_length, int *mismatches);
+GSF_API GsfError gsf_render_segmented_with_allocators(GsfRenderJob *job,
+    const GsfRenderOptions *options, long segment_length, int *mismatches,
+    GsfAllocators *allocators);
+
 #ifdef __cplusplus
 }
 #endif
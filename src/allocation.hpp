@@ -58,9 +58,9 @@ struct GsfAllocator {
         return static_cast<T *>(allocators.malloc(count * sizeof(T), allocators.userdata));
     }
 
-    void deallocate(T *p, size_type size)
+    void deallocate(T *p, size_type count)
     {
-        allocators.free(p, size, allocators.userdata);
+        allocators.free(p, count * sizeof(T), allocators.userdata);
     }
 
     bool operator==(const GsfAllocator<T> &other) const
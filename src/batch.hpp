@@ -0,0 +1,187 @@
+#pragma once
+
+/*
+ * Batch rendering: gsf_render and gsf_render_segmented. This builds on
+ * GsfEmu and the rest of gsf.cpp, which includes it right after them; it
+ * isn't meant to be included anywhere else.
+ */
+
+#include "gsf.h"
+
+#include <algorithm>
+#include <atomic>
+#include <mutex>
+#include "pool.hpp"
+
+// What each thread of gsf_render keeps between files.
+struct RenderWorker {
+    GsfEmu *emu = nullptr;
+    Vector<short> buf;
+
+    // Emulators are created on first use, so that threads that end up with
+    // nothing to do don't pay for one.
+    GsfError create(const GsfRenderOptions &options, GsfAllocators *allocators)
+    {
+        if (emu)
+            return { .code = 0, .from = 0 };
+        auto flags = options.flags & ~GSF_INFO_ONLY;
+        if (auto err = gsf_new_with_allocators(&emu, options.sample_rate, flags, allocators); err.code != 0) {
+            emu = nullptr;
+            return err;
+        }
+        emu->set_snapshots(0, 0);
+        emu->set_fade(options.fade);
+        emu->set_tag_volume(options.tag_volume);
+        buf.resize(NUM_SAMPLES * emu->num_channels());
+        return { .code = 0, .from = 0 };
+    }
+
+    GsfError load(const char *filename, const GsfRenderOptions &options, GsfAllocators *allocators)
+    {
+        if (options.default_length != 0)
+            emu->set_default_length(options.default_length);
+        if (auto err = gsf_load_file_with_allocators(emu, filename, allocators); err.code != 0)
+            return err;
+        if (options.length != 0)
+            emu->set_length(options.length);
+        return { .code = 0, .from = 0 };
+    }
+};
+
+// All workers of a render, deleting their emulators once it's done.
+class RenderWorkers {
+    Vector<RenderWorker> workers;
+    GsfAllocators *allocators;
+
+public:
+    RenderWorkers(int threads, GsfAllocators *allocators)
+        : workers(GsfAllocator<RenderWorker>(*allocators)), allocators{allocators}
+    {
+        workers.reserve(threads);
+        for (auto i = 0; i < threads; i++)
+            workers.push_back(RenderWorker { nullptr, Vector<short>(GsfAllocator<short>(*allocators)) });
+    }
+
+    ~RenderWorkers()
+    {
+        for (auto &worker : workers)
+            if (worker.emu)
+                gsf_delete_with_allocators(worker.emu, allocators);
+    }
+
+    RenderWorker &operator[](int i) { return workers[i]; }
+};
+
+GsfError render_file(RenderWorker &worker, GsfRenderJob &job, const GsfRenderOptions &options,
+    GsfAllocators *allocators)
+{
+    if (auto err = worker.load(job.filename, options, allocators); err.code != 0)
+        return err;
+    auto *emu = worker.emu;
+    while (!emu->ended()) {
+        auto start = emu->tell();
+        emu->play(Output { .format = Output::Format::S16, .data = worker.buf.data() }, worker.buf.size());
+        auto n = emu->tell() - start;
+        job.samples += n;
+        if (job.write && !job.write(worker.buf.data(), n, job.userdata))
+            break;
+    }
+    return { .code = 0, .from = 0 };
+}
+
+// How far each segment is rendered into the next one, to check that both
+// agree on those samples.
+constexpr long SEAM_CHECK_FRAMES = NUM_SAMPLES;
+
+// When no segment length is given, aim for this many segments per thread,
+// so that threads even out, but no shorter than a second each.
+constexpr int SEGMENTS_PER_THREAD = 4;
+constexpr long MIN_SEGMENT_LENGTH = 1000;
+
+struct RenderSegment {
+    Vector<short> samples;
+    long length;            // not counting the samples rendered for the seam check
+    bool rendered = false;
+};
+
+GsfError render_segments(RenderWorkers &workers, int threads, GsfRenderJob &job,
+    const GsfRenderOptions &options, long segment_length, int *mismatches, GsfAllocators *allocators)
+{
+    auto &first = workers[0];
+    if (auto err = first.create(options, allocators); err.code != 0)
+        return err;
+    if (auto err = first.load(job.filename, options, allocators); err.code != 0)
+        return err;
+    auto *emu = first.emu;
+    auto channels = emu->num_channels();
+    auto end = std::max(0l, emu->end_samples());
+    auto interval = segment_length > 0
+        ? millis_to_samples(segment_length, emu->sample_rate(), channels)
+        : std::max(end / (threads * SEGMENTS_PER_THREAD) / channels * channels,
+                   millis_to_samples(MIN_SEGMENT_LENGTH, emu->sample_rate(), channels));
+    auto snapshots = emu->capture_segments(std::max(interval, long(channels)));
+    if (!snapshots)
+        return snapshots.error();
+
+    auto count = snapshots->size();
+    auto segments = Vector<RenderSegment>(GsfAllocator<RenderSegment>(*allocators));
+    segments.reserve(count);
+    for (std::size_t i = 0; i < count; i++) {
+        auto next = i + 1 < count ? (*snapshots)[i + 1].position : end;
+        segments.push_back(RenderSegment {
+            Vector<short>(GsfAllocator<short>(*allocators)),
+            std::max(0l, next - (*snapshots)[i].position),
+        });
+    }
+    auto ready = Vector<u8>(threads, 0, GsfAllocator<u8>(*allocators));
+    ready[0] = 1;
+    auto error = GsfError { .code = 0, .from = 0 };
+    std::atomic<bool> stop = false;
+    std::mutex mutex;
+    std::size_t next = 0;
+
+    pool::run(count, threads, [&](int index, std::size_t i) {
+        if (stop)
+            return;
+        auto &worker = workers[index];
+        auto &segment = segments[i];
+        auto err = GsfError { .code = 0, .from = 0 };
+        if (!ready[index]) {
+            err = worker.create(options, allocators);
+            if (err.code == 0)
+                err = worker.load(job.filename, options, allocators);
+            ready[index] = err.code == 0;
+        }
+        if (err.code == 0 && !worker.emu->load_snapshot((*snapshots)[i]))
+            err = make_err(GSF_ALLOCATION_FAILED);
+        if (err.code == 0) {
+            auto check = i + 1 < count ? std::min(SEAM_CHECK_FRAMES * channels, segments[i + 1].length) : 0;
+            segment.samples.resize(segment.length + check);
+            worker.emu->play(Output { .format = Output::Format::S16, .data = segment.samples.data() },
+                             segment.samples.size());
+        }
+
+        // hand segments over in order, as soon as all those before them are
+        auto lock = std::lock_guard(mutex);
+        if (err.code != 0) {
+            error = err;
+            stop = true;
+            return;
+        }
+        segment.rendered = true;
+        for (; next < count && segments[next].rendered && !stop; next++) {
+            auto &cur = segments[next];
+            if (next > 0) {
+                auto &prev = segments[next - 1];
+                auto seam = prev.samples.begin() + prev.length;
+                if (mismatches && !std::equal(seam, prev.samples.end(), cur.samples.begin()))
+                    (*mismatches)++;
+                prev.samples = Vector<short>(GsfAllocator<short>(*allocators));
+            }
+            job.samples += cur.length;
+            if (job.write && cur.length > 0 && !job.write(cur.samples.data(), cur.length, job.userdata))
+                stop = true;
+        }
+    }, pool::Deal::ROUND_ROBIN);
+    return error;
+}
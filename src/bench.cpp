@@ -0,0 +1,1123 @@
+/* Benchmarks for libgsf. Run without arguments to see the available ones. */
+
+#include "gsf.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <chrono>
+#include <cmath>
+#include <complex>
+#include <filesystem>
+#include <numbers>
+#include <string>
+#include <thread>
+#include <vector>
+#if defined(__unix__) || defined(__APPLE__)
+#include <fcntl.h>
+#include <unistd.h>
+#endif
+
+#ifndef GSF_TESTFILES_DIR
+#define GSF_TESTFILES_DIR "testfiles"
+#endif
+
+using Clock = std::chrono::steady_clock;
+
+double millis_since(Clock::time_point start)
+{
+    return std::chrono::duration<double, std::milli>(Clock::now() - start).count();
+}
+
+GsfEmu *open_file(const char *filename, int flags)
+{
+    GsfEmu *emu;
+    if (gsf_new(&emu, 44100, flags).code != 0) {
+        std::fprintf(stderr, "couldn't create emulator\n");
+        return nullptr;
+    }
+    gsf_set_default_length(emu, 180000);
+    if (auto err = gsf_load_file(emu, filename); err.code != 0) {
+        std::fprintf(stderr, "%s: couldn't load file (error %d, %d)\n", filename, err.code, err.from);
+        gsf_delete(emu);
+        return nullptr;
+    }
+    return emu;
+}
+
+// Measures how long it takes to seek backwards from the end of a file to
+// various positions, with and without seek snapshots and fast seeking.
+int bench_seek(int argc, char *argv[])
+{
+    if (argc < 1) {
+        std::fprintf(stderr, "usage: gsf_bench seek <file> [points]\n");
+        return 1;
+    }
+    int points = argc > 1 ? std::atoi(argv[1]) : 10;
+    auto *emu = open_file(argv[0], 0);
+    if (!emu)
+        return 1;
+    long length = gsf_length(emu);
+    struct { bool snapshots, fast; } modes[] = { { true, true }, { true, false }, { false, true }, { false, false } };
+    std::vector<double> results[4];
+    for (int mode = 0; mode < 4; mode++) {
+        // start with no snapshots: those taken while fast seeking aren't
+        // used for exact seeks
+        gsf_set_seek_snapshots(emu, 0, 0);
+        gsf_set_seek_snapshots(emu, modes[mode].snapshots ? 10000 : 0, 16 * 1024 * 1024);
+        gsf_set_fast_seek(emu, modes[mode].fast);
+        // play through the whole file first, so that snapshots get taken
+        gsf_seek(emu, 0);
+        gsf_seek(emu, length);
+        for (int i = 0; i <= points; i++) {
+            gsf_seek(emu, length);
+            auto start = Clock::now();
+            gsf_seek(emu, length * i / points);
+            results[mode].push_back(millis_since(start));
+        }
+    }
+    std::printf("%12s %16s %16s %16s %16s\n", "position ms",
+        "snapshots fast", "snapshots exact", "replay fast", "replay exact");
+    for (int i = 0; i <= points; i++)
+        std::printf("%12ld %16.2f %16.2f %16.2f %16.2f\n", length * i / points,
+            results[0][i], results[1][i], results[2][i], results[3][i]);
+    gsf_delete(emu);
+    return 0;
+}
+
+// Measures how many files per second can be scanned for their tags, the way a
+// library indexer would do it. Files are scanned repeatedly for about a second.
+int bench_scan(int argc, char *argv[])
+{
+    if (argc < 1) {
+        std::fprintf(stderr, "usage: gsf_bench scan <files...>\n");
+        return 1;
+    }
+    GsfEmu *emu;
+    if (gsf_new(&emu, 44100, GSF_INFO_ONLY).code != 0) {
+        std::fprintf(stderr, "couldn't create emulator\n");
+        return 1;
+    }
+    long scanned = 0, failed = 0;
+    auto start = Clock::now();
+    do {
+        for (int i = 0; i < argc; i++) {
+            GsfTags *tags;
+            if (gsf_load_file(emu, argv[i]).code != 0 || gsf_get_tags(emu, &tags).code != 0) {
+                failed++;
+                continue;
+            }
+            gsf_free_tags(tags);
+            scanned++;
+        }
+    } while (millis_since(start) < 1000.0);
+    auto elapsed = millis_since(start);
+    std::printf("%ld files scanned (%ld failed) in %.2f ms: %.0f files/s\n",
+        scanned, failed, elapsed, scanned / elapsed * 1000.0);
+    gsf_delete(emu);
+    return 0;
+}
+
+// Measures playback throughput, in emulated seconds per wall clock second.
+// Each file is played from the start for about a second.
+int bench_play(int argc, char *argv[])
+{
+    if (argc < 1) {
+        std::fprintf(stderr, "usage: gsf_bench play <files...>\n");
+        return 1;
+    }
+    std::vector<short> buf(4096);
+    std::printf("%-40s %14s %12s\n", "file", "emulated s/s", "idle loop");
+    for (int i = 0; i < argc; i++) {
+        auto *emu = open_file(argv[i], 0);
+        if (!emu)
+            continue;
+        auto start = Clock::now();
+        do
+            gsf_play(emu, buf.data(), buf.size());
+        while (millis_since(start) < 1000.0);
+        auto elapsed = millis_since(start);
+        unsigned long idle_loop;
+        char idle_loop_str[16] = "none";
+        if (gsf_get_idle_loop(emu, &idle_loop))
+            std::snprintf(idle_loop_str, sizeof(idle_loop_str), "%08lx", idle_loop);
+        std::printf("%-40s %14.1f %12s\n", argv[i], gsf_tell(emu) / elapsed, idle_loop_str);
+        gsf_delete(emu);
+    }
+    return 0;
+}
+
+// Measures how playback throughput scales with the number of threads, each
+// playing with its own emulator. Every thread plays the same amount of audio,
+// going through the files in turn, starting from a different one.
+int bench_threads(int argc, char *argv[])
+{
+    int max_threads = std::max(1u, std::thread::hardware_concurrency());
+    if (argc > 2 && std::strcmp(argv[0], "-j") == 0) {
+        max_threads = std::max(1, std::atoi(argv[1]));
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 1) {
+        std::fprintf(stderr, "usage: gsf_bench threads [-j max threads] <files...>\n");
+        return 1;
+    }
+    const long seconds = 20;
+    std::vector<int> counts;
+    for (int n = 1; n < max_threads; n *= 2)
+        counts.push_back(n);
+    counts.push_back(max_threads);
+    std::printf("%8s %14s %10s %12s\n", "threads", "emulated s/s", "speedup", "efficiency");
+    double base = 0.0;
+    for (int n : counts) {
+        std::vector<std::thread> threads;
+        auto start = Clock::now();
+        for (int t = 0; t < n; t++) {
+            threads.emplace_back([=] {
+                std::vector<short> buf(4096);
+                for (long played = 0, i = t; played < seconds * 1000; i++) {
+                    auto *emu = open_file(argv[i % argc], 0);
+                    if (!emu)
+                        return;
+                    gsf_set_infinite(emu, true);
+                    while (gsf_tell(emu) < 5000 && played + gsf_tell(emu) < seconds * 1000)
+                        gsf_play(emu, buf.data(), buf.size());
+                    played += gsf_tell(emu);
+                    gsf_delete(emu);
+                }
+            });
+        }
+        for (auto &t : threads)
+            t.join();
+        auto throughput = n * seconds / (millis_since(start) / 1000.0);
+        if (n == 1)
+            base = throughput;
+        std::printf("%8d %14.1f %10.2f %11.0f%%\n", n, throughput, throughput / base,
+            throughput / base / n * 100.0);
+    }
+    return 0;
+}
+
+// Measures the cost of gsf_play per sample depending on the size of the
+// buffer passed to it. Each size plays the same amount of audio.
+int bench_chunk(int argc, char *argv[])
+{
+    if (argc < 1) {
+        std::fprintf(stderr, "usage: gsf_bench chunk <file> [seconds]\n");
+        return 1;
+    }
+    long seconds = argc > 1 ? std::atol(argv[1]) : 30;
+    auto *emu = open_file(argv[0], 0);
+    if (!emu)
+        return 1;
+    gsf_set_infinite(emu, true);
+    long total = seconds * 44100 * 2;
+    std::printf("%10s %12s\n", "size", "ns/sample");
+    for (long size : { 16, 64, 256, 1024, 4096, 16384, 65536 }) {
+        std::vector<short> buf(size);
+        gsf_seek(emu, 0);
+        auto start = Clock::now();
+        for (long played = 0; played < total; played += size)
+            gsf_play(emu, buf.data(), size);
+        std::printf("%10ld %12.2f\n", size, millis_since(start) * 1e6 / total);
+    }
+    gsf_delete(emu);
+    return 0;
+}
+
+// Measures the cost of each output format per frame, including converting
+// 16-bit samples to floats on the caller's side, the way it had to be done
+// before the library could output floats itself.
+int bench_formats(int argc, char *argv[])
+{
+    if (argc < 1) {
+        std::fprintf(stderr, "usage: gsf_bench formats <file> [seconds]\n");
+        return 1;
+    }
+    long seconds = argc > 1 ? std::atol(argv[1]) : 30;
+    auto *emu = open_file(argv[0], 0);
+    if (!emu)
+        return 1;
+    gsf_set_infinite(emu, true);
+    const long frames = 1024, total = seconds * 44100;
+    std::vector<short> s16(frames * 2);
+    std::vector<float> f32(frames * 2), left(frames), right(frames);
+    float *planes[] = { left.data(), right.data() };
+    struct { const char *name; void (*play)(GsfEmu *, short *, float *, float **); } formats[] = {
+        { "s16", [](GsfEmu *emu, short *s, float *, float **) { gsf_play(emu, s, frames * 2); } },
+        { "s16 + caller f32", [](GsfEmu *emu, short *s, float *f, float **) {
+            gsf_play(emu, s, frames * 2);
+            for (long i = 0; i < frames * 2; i++)
+                f[i] = s[i] / 32768.0f;
+        } },
+        { "f32", [](GsfEmu *emu, short *, float *f, float **) { gsf_play_f32(emu, f, frames * 2); } },
+        { "planar f32", [](GsfEmu *emu, short *, float *, float **p) { gsf_play_planar_f32(emu, p, frames); } },
+        { "mono f32", [](GsfEmu *emu, short *, float *f, float **) { gsf_play_mono_f32(emu, f, frames); } },
+    };
+    std::printf("%-18s %12s\n", "format", "ns/frame");
+    for (const auto &format : formats) {
+        gsf_seek(emu, 0);
+        auto start = Clock::now();
+        for (long played = 0; played < total; played += frames)
+            format.play(emu, s16.data(), f32.data(), planes);
+        std::printf("%-18s %12.2f\n", format.name, millis_since(start) * 1e6 / total);
+    }
+    gsf_delete(emu);
+    return 0;
+}
+
+// In-place radix-2 FFT; the size of `x` must be a power of two.
+void fft(std::vector<std::complex<double>> &x)
+{
+    auto n = x.size();
+    for (size_t i = 1, j = 0; i < n; i++) {
+        size_t bit = n >> 1;
+        for (; j & bit; bit >>= 1)
+            j ^= bit;
+        j ^= bit;
+        if (i < j)
+            std::swap(x[i], x[j]);
+    }
+    for (size_t len = 2; len <= n; len <<= 1) {
+        auto w = std::polar(1.0, -2.0 * std::numbers::pi / len);
+        for (size_t i = 0; i < n; i += len) {
+            std::complex<double> wk = 1.0;
+            for (size_t k = 0; k < len / 2; k++, wk *= w) {
+                auto a = x[i + k], b = x[i + k + len / 2] * wk;
+                x[i + k]           = a + b;
+                x[i + k + len / 2] = a - b;
+            }
+        }
+    }
+}
+
+// Energy of the left channel above `cutoff` Hz, relative to all of it, in dB.
+// The GBA can't produce anything above half its native rate, so for output
+// rates higher than that, whatever ends up there is aliasing.
+double energy_above(const std::vector<short> &samples, int rate, double cutoff)
+{
+    const size_t size = 4096;
+    double above = 0.0, total = 0.0;
+    std::vector<std::complex<double>> block(size);
+    for (size_t start = 0; start + size * 2 <= samples.size(); start += size * 2) {
+        for (size_t i = 0; i < size; i++) {
+            auto window = 0.5 - 0.5 * std::cos(2.0 * std::numbers::pi * i / size);
+            block[i] = samples[start + i * 2] * window;
+        }
+        fft(block);
+        for (size_t i = 1; i < size / 2; i++) {
+            auto power = std::norm(block[i]);
+            total += power;
+            if (double(i) * rate / size > cutoff)
+                above += power;
+        }
+    }
+    return 10.0 * std::log10(above / total);
+}
+
+// Measures the cost of each resampler against how much aliasing it leaves
+// above 16 kHz (at 44100 Hz; at the native rate there's no room for any).
+int bench_resample(int argc, char *argv[])
+{
+    if (argc < 1) {
+        std::fprintf(stderr, "usage: gsf_bench resample <file> [seconds]\n");
+        return 1;
+    }
+    long seconds = argc > 1 ? std::atol(argv[1]) : 30;
+    struct { const char *name; int flags; } resamplers[] = {
+        { "blip_buf", 0 },
+        { "native", GSF_RESAMPLER_NATIVE },
+        { "sinc", GSF_RESAMPLER_SINC },
+    };
+    std::printf("%-10s %8s %12s %14s\n", "resampler", "rate", "ns/frame", "dB above 16k");
+    for (const auto &r : resamplers) {
+        auto *emu = open_file(argv[0], r.flags);
+        if (!emu)
+            return 1;
+        gsf_set_infinite(emu, true);
+        int rate = gsf_sample_rate(emu);
+        std::vector<short> samples(seconds * rate * 2);
+        auto start = Clock::now();
+        for (size_t played = 0; played < samples.size(); played += 4096)
+            gsf_play(emu, samples.data() + played, std::min<size_t>(4096, samples.size() - played));
+        auto elapsed = millis_since(start);
+        char quality[32] = "-";
+        if (rate > 32768)
+            std::snprintf(quality, sizeof(quality), "%.1f", energy_above(samples, rate, 16384.0));
+        std::printf("%-10s %8d %12.2f %14s\n", r.name, rate, elapsed * 1e6 / (samples.size() / 2), quality);
+        gsf_delete(emu);
+    }
+    return 0;
+}
+
+// Asks the OS to drop a file from the page cache. Only works on systems with
+// posix_fadvise; elsewhere the "cold" results are really warm ones.
+void drop_cache(const std::filesystem::path &path)
+{
+#if defined(POSIX_FADV_DONTNEED)
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return;
+    ::fdatasync(fd);
+    ::posix_fadvise(fd, 0, 0, POSIX_FADV_DONTNEED);
+    ::close(fd);
+#endif
+}
+
+// Drops every file in the directory of each given file, so that libraries
+// are loaded from disk too.
+void drop_caches(int argc, char *argv[])
+{
+    std::error_code ec;
+    for (int i = 0; i < argc; i++)
+        for (const auto &entry : std::filesystem::directory_iterator(
+                std::filesystem::path(argv[i]).parent_path() / "", ec))
+            if (entry.is_regular_file(ec))
+                drop_cache(entry.path());
+}
+
+// Measures how long it takes to load files, with a cold and a warm page cache,
+// both with the stdio reader and the mmap reader. The library cache is
+// disabled, so that every library is read again each time.
+int bench_load(int argc, char *argv[])
+{
+    if (argc < 1) {
+        std::fprintf(stderr, "usage: gsf_bench load <files...>\n");
+        return 1;
+    }
+    GsfEmu *emu;
+    if (gsf_new(&emu, 44100, 0).code != 0) {
+        std::fprintf(stderr, "couldn't create emulator\n");
+        return 1;
+    }
+    gsf_set_lib_cache_size(0);
+    GsfReader readers[] = { gsf_stdio_reader(), gsf_mmap_reader() };
+    const char *names[] = { "stdio", "mmap" };
+    std::printf("%8s %14s %14s\n", "reader", "cold ms/file", "warm ms/file");
+    for (int r = 0; r < 2; r++) {
+        double results[2] = { 0, 0 };
+        for (int warm = 0; warm < 2; warm++) {
+            if (!warm)
+                drop_caches(argc, argv);
+            for (int i = 0; i < argc; i++) {
+                auto start = Clock::now();
+                if (auto err = gsf_load_file_with_reader(emu, argv[i], &readers[r]); err.code != 0)
+                    std::fprintf(stderr, "%s: couldn't load file (error %d, %d)\n", argv[i], err.code, err.from);
+                results[warm] += millis_since(start);
+            }
+        }
+        std::printf("%8s %14.3f %14.3f\n", names[r], results[0] / argc, results[1] / argc);
+    }
+    gsf_delete(emu);
+    return 0;
+}
+
+// Measures the per-track cost of getting from a file name to the first
+// samples and back: with a new emulator per track, with one emulator
+// reused, and with a pool.
+int bench_reuse(int argc, char *argv[])
+{
+    if (argc < 1) {
+        std::fprintf(stderr, "usage: gsf_bench reuse <files...>\n");
+        return 1;
+    }
+    constexpr int rounds = 20;
+    short buf[2048];
+    auto first_samples = [&](GsfEmu *emu, const char *filename) {
+        if (auto err = gsf_load_file(emu, filename); err.code != 0)
+            std::fprintf(stderr, "%s: couldn't load file (error %d, %d)\n", filename, err.code, err.from);
+        gsf_play(emu, buf, 2048);
+    };
+    double results[3] = { 0, 0, 0 };
+
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < argc; i++) {
+            auto start = Clock::now();
+            GsfEmu *emu;
+            if (gsf_new(&emu, 44100, 0).code != 0) {
+                std::fprintf(stderr, "couldn't create emulator\n");
+                return 1;
+            }
+            first_samples(emu, argv[i]);
+            gsf_delete(emu);
+            results[0] += millis_since(start);
+        }
+    }
+
+    GsfEmu *emu;
+    if (gsf_new(&emu, 44100, 0).code != 0) {
+        std::fprintf(stderr, "couldn't create emulator\n");
+        return 1;
+    }
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < argc; i++) {
+            auto start = Clock::now();
+            first_samples(emu, argv[i]);
+            gsf_unload(emu);
+            results[1] += millis_since(start);
+        }
+    }
+    gsf_delete(emu);
+
+    GsfEmuPool *pool;
+    if (gsf_pool_new(&pool, 44100, 0, 1).code != 0) {
+        std::fprintf(stderr, "couldn't create pool\n");
+        return 1;
+    }
+    for (int r = 0; r < rounds; r++) {
+        for (int i = 0; i < argc; i++) {
+            auto start = Clock::now();
+            if (gsf_pool_acquire(pool, &emu).code != 0) {
+                std::fprintf(stderr, "couldn't create emulator\n");
+                return 1;
+            }
+            first_samples(emu, argv[i]);
+            gsf_pool_release(pool, emu);
+            results[2] += millis_since(start);
+        }
+    }
+    gsf_pool_delete(pool);
+
+    const char *names[] = { "new emulator", "reused", "pool" };
+    std::printf("%14s %14s\n", "", "ms/track");
+    for (int i = 0; i < 3; i++)
+        std::printf("%14s %14.3f\n", names[i], results[i] / (rounds * argc));
+    return 0;
+}
+
+// Memory used by this process in KiB, or -1 where unknown. This is the
+// proportional set size rather than the resident one, which would count pages
+// shared by several mappings once for each.
+long memory_kib()
+{
+    long kib = -1;
+#ifdef __linux__
+    if (auto *f = std::fopen("/proc/self/smaps_rollup", "r"); f) {
+        char line[256];
+        while (std::fgets(line, sizeof(line), f))
+            if (std::sscanf(line, "Pss: %ld kB", &kib) == 1)
+                break;
+        std::fclose(f);
+    }
+#endif
+    return kib;
+}
+
+// Measures how much memory each playing emulator costs, with
+// libraries shared through the library cache and with it disabled, where
+// every emulator has its own copy of the rom.
+int bench_memory(int argc, char *argv[])
+{
+    int count = 16;
+    if (argc > 2 && std::strcmp(argv[0], "-n") == 0) {
+        count = std::max(1, std::atoi(argv[1]));
+        argc -= 2;
+        argv += 2;
+    }
+    if (argc < 1) {
+        std::fprintf(stderr, "usage: gsf_bench memory [-n emulators] <files...>\n");
+        return 1;
+    }
+    if (memory_kib() < 0) {
+        std::fprintf(stderr, "can't measure memory use on this platform\n");
+        return 1;
+    }
+    std::printf("%14s %14s\n", "", "KiB/emulator");
+    for (auto shared : { true, false }) {
+        if (!shared)
+            gsf_set_lib_cache_size(0);
+        // load each file once first, so the cache doesn't count
+        for (int i = 0; i < argc; i++)
+            if (auto *emu = open_file(argv[i], 0); emu)
+                gsf_delete(emu);
+        auto before = memory_kib();
+        auto emus = std::vector<GsfEmu *>{};
+        short buf[2048];
+        for (int i = 0; i < count; i++) {
+            auto *emu = open_file(argv[i % argc], 0);
+            if (!emu)
+                break;
+            gsf_play(emu, buf, 2048);
+            emus.push_back(emu);
+        }
+        auto after = memory_kib();
+        if (!emus.empty())
+            std::printf("%14s %14.1f\n", shared ? "shared" : "copied", double(after - before) / emus.size());
+        for (auto *emu : emus)
+            gsf_delete(emu);
+    }
+    return 0;
+}
+
+// Measures how long gsf_play_budgeted blocks for with various budgets, which
+// is what a real-time audio thread calling it would have to allow for, and
+// how far gsf_play_cost is from the budget actually needed.
+int bench_budget(int argc, char *argv[])
+{
+    if (argc < 1) {
+        std::fprintf(stderr, "usage: gsf_bench budget <file> [seconds]\n");
+        return 1;
+    }
+    long seconds = argc > 1 ? std::atol(argv[1]) : 30;
+    std::printf("%14s %10s %12s %12s %14s\n", "budget (ms)", "calls", "mean (us)", "max (us)", "cost/emulated");
+    for (long millis : { 1, 5, 20, 100 }) {
+        auto *emu = open_file(argv[0], 0);
+        if (!emu)
+            return 1;
+        gsf_set_seek_snapshots(emu, 0, 0);
+        long budget = GSF_CYCLES_PER_SECOND / 1000 * millis;
+        long total = seconds * 44100 * 2, done = 0, calls = 0;
+        double max = 0, sum = 0, cost = 0;
+        short buf[2048];
+        while (done < total && !gsf_ended(emu)) {
+            auto want = std::min(2048L, total - done);
+            cost += gsf_play_cost(emu, want);
+            auto start = Clock::now();
+            auto got = gsf_play_budgeted(emu, buf, want, budget);
+            auto elapsed = millis_since(start) * 1000;
+            // whatever wasn't played gets asked for (and estimated) again
+            cost -= gsf_play_cost(emu, want - got);
+            max = std::max(max, elapsed);
+            sum += elapsed;
+            done += got;
+            calls++;
+        }
+        auto emulated = double(done) / (44100 * 2) * GSF_CYCLES_PER_SECOND;
+        std::printf("%14ld %10ld %12.1f %12.1f %14.3f\n", millis, calls, sum / calls, max, cost / emulated);
+        gsf_delete(emu);
+    }
+    return 0;
+}
+
+// Breaks down where the time goes when loading each file, with an empty
+// library cache and with a warm one, using gsf_get_stats.
+int bench_phases(int argc, char *argv[])
+{
+    if (argc < 1) {
+        std::fprintf(stderr, "usage: gsf_bench phases <files...>\n");
+        return 1;
+    }
+    std::printf("%-40s %6s %12s %8s %8s %8s %8s %8s\n", "", "cache", "inflated", "read", "parse",
+        "inflate", "impose", "setup");
+    for (int i = 0; i < argc; i++) {
+        gsf_clear_lib_cache();
+        for (auto warm : { false, true }) {
+            auto *emu = open_file(argv[i], 0);
+            if (!emu)
+                break;
+            GsfStats stats;
+            gsf_get_stats(emu, &stats);
+            std::printf("%-40s %6s %12llu %8.2f %8.2f %8.2f %8.2f %8.2f\n", warm ? "" : argv[i],
+                warm ? "warm" : "cold", stats.bytes_inflated, stats.read_ms, stats.parse_ms,
+                stats.inflate_ms, stats.impose_ms, stats.setup_ms);
+            gsf_delete(emu);
+        }
+    }
+    std::printf("(times in ms)\n");
+    return 0;
+}
+
+// Allocators that keep track of how much memory the library has allocated
+// through them, and the most it ever had at once. The library cache and mGBA
+// itself don't allocate through them.
+struct AllocCounter {
+    std::atomic<std::size_t> current = 0;
+    std::atomic<std::size_t> peak = 0;
+    std::atomic<std::size_t> count = 0;
+
+    GsfAllocators allocators()
+    {
+        return GsfAllocators { counting_malloc, counting_free, this };
+    }
+
+    static void *counting_malloc(std::size_t size, void *userdata)
+    {
+        auto *self = static_cast<AllocCounter *>(userdata);
+        auto *p = std::malloc(size);
+        if (!p)
+            return nullptr;
+        auto now = self->current.fetch_add(size) + size;
+        auto peak = self->peak.load();
+        while (now > peak && !self->peak.compare_exchange_weak(peak, now))
+            ;
+        self->count++;
+        return p;
+    }
+
+    static void counting_free(void *p, std::size_t size, void *userdata)
+    {
+        if (!p)
+            return;
+        static_cast<AllocCounter *>(userdata)->current -= size;
+        std::free(p);
+    }
+};
+
+// Just enough of a JSON writer for the suite's results.
+class Json {
+    std::string out;
+    bool first = true;
+
+    void separate()
+    {
+        if (!first)
+            out += ',';
+        first = false;
+    }
+
+    void key(const char *name)
+    {
+        separate();
+        string(name);
+        out += ':';
+    }
+
+    void string(const char *s)
+    {
+        out += '"';
+        for (; *s; s++) {
+            if (*s == '"' || *s == '\\')
+                out += '\\';
+            if (static_cast<unsigned char>(*s) < 0x20) {
+                char buf[8];
+                std::snprintf(buf, sizeof(buf), "\\u%04x", *s);
+                out += buf;
+            } else
+                out += *s;
+        }
+        out += '"';
+    }
+
+public:
+    void begin_object(const char *name = nullptr)
+    {
+        if (name)
+            key(name);
+        else
+            separate();
+        out += '{';
+        first = true;
+    }
+
+    void end_object() { out += '}'; first = false; }
+
+    void begin_array(const char *name)
+    {
+        key(name);
+        out += '[';
+        first = true;
+    }
+
+    void end_array() { out += ']'; first = false; }
+
+    void field(const char *name, const char *value) { key(name); string(value); }
+
+    void field(const char *name, unsigned long long value)
+    {
+        key(name);
+        out += std::to_string(value);
+    }
+
+    void field(const char *name, double value)
+    {
+        key(name);
+        char buf[32];
+        std::snprintf(buf, sizeof(buf), "%.6g", std::isfinite(value) ? value : 0.0);
+        out += buf;
+    }
+
+    const std::string &str() const { return out; }
+};
+
+// The files given, or every track in testfiles/ if there are none.
+std::vector<std::string> files_or_testfiles(int argc, char *argv[])
+{
+    auto files = std::vector<std::string>(argv, argv + argc);
+    if (files.empty()) {
+        std::error_code ec;
+        for (const auto &entry : std::filesystem::directory_iterator(GSF_TESTFILES_DIR, ec))
+            if (auto ext = entry.path().extension(); ext == ".minigsf" || ext == ".gsf")
+                files.push_back(entry.path().string());
+        std::sort(files.begin(), files.end());
+    }
+    return files;
+}
+
+struct SuiteResult {
+    std::string file;
+    double load_cold_ms = 0, load_warm_ms = 0;
+    static constexpr long buffer_sizes[] = { 256, 1024, 4096, 16384 };
+    double play[std::size(buffer_sizes)] = {};
+    double seek_forward_ms = 0, seek_backward_ms = 0;
+    unsigned long long peak_bytes = 0, allocations = 0;
+};
+
+// Emulated seconds per second when playing `seconds` of a file in buffers of
+// `size` samples.
+double play_throughput(GsfEmu *emu, long size, long seconds)
+{
+    std::vector<short> buf(size);
+    gsf_seek(emu, 0);
+    long total = seconds * 44100 * 2;
+    auto start = Clock::now();
+    for (long done = 0; done < total && !gsf_ended(emu); done += size)
+        gsf_play(emu, buf.data(), std::min(size, total - done));
+    return gsf_tell(emu) / millis_since(start);
+}
+
+bool run_suite_file(const char *filename, SuiteResult &r)
+{
+    r.file = filename;
+    auto load = [&](bool warm) {
+        if (!warm) {
+            gsf_clear_lib_cache();
+            drop_caches(1, const_cast<char **>(&filename));
+        }
+        auto start = Clock::now();
+        auto *emu = open_file(filename, 0);
+        auto elapsed = millis_since(start);
+        if (emu)
+            gsf_delete(emu);
+        return emu ? elapsed : -1.0;
+    };
+    r.load_cold_ms = load(false);
+    r.load_warm_ms = load(true);
+    if (r.load_cold_ms < 0)
+        return false;
+
+    auto counter = AllocCounter{};
+    auto allocators = counter.allocators();
+    GsfEmu *emu;
+    if (gsf_new_with_allocators(&emu, 44100, 0, &allocators).code != 0)
+        return false;
+    gsf_set_default_length(emu, 180000);
+    if (gsf_load_file_with_allocators(emu, filename, &allocators).code != 0) {
+        gsf_delete_with_allocators(emu, &allocators);
+        return false;
+    }
+    for (std::size_t i = 0; i < std::size(r.buffer_sizes); i++)
+        r.play[i] = play_throughput(emu, r.buffer_sizes[i], 10);
+
+    // forward from the start, then backward from the end, where the seek
+    // snapshots taken on the way forward help
+    auto length = gsf_length(emu);
+    gsf_seek(emu, 0);
+    auto start = Clock::now();
+    gsf_seek(emu, length * 3 / 4);
+    r.seek_forward_ms = millis_since(start);
+    gsf_seek(emu, length);
+    start = Clock::now();
+    gsf_seek(emu, length / 4);
+    r.seek_backward_ms = millis_since(start);
+
+    r.peak_bytes  = counter.peak;
+    r.allocations = counter.count;
+    gsf_delete_with_allocators(emu, &allocators);
+    return true;
+}
+
+// Runs a bit of every kind of benchmark on each file (by default, those in
+// testfiles/) and prints the results as a table, or as JSON with --json, for
+// comparing versions.
+int bench_suite(int argc, char *argv[])
+{
+    bool json = argc > 0 && std::strcmp(argv[0], "--json") == 0;
+    if (json) {
+        argc--;
+        argv++;
+    }
+    auto files = files_or_testfiles(argc, argv);
+    if (files.empty()) {
+        std::fprintf(stderr, "usage: gsf_bench suite [--json] [files...]\n");
+        return 1;
+    }
+
+    auto results = std::vector<SuiteResult>(files.size());
+    int failed = 0;
+    for (std::size_t i = 0; i < files.size(); i++) {
+        if (!run_suite_file(files[i].c_str(), results[i])) {
+            std::fprintf(stderr, "%s: couldn't load file\n", files[i].c_str());
+            failed++;
+        }
+    }
+
+    // tags only, for about a second
+    GsfEmu *info;
+    double scan_rate = 0;
+    if (gsf_new(&info, 44100, GSF_INFO_ONLY).code == 0) {
+        long scanned = 0;
+        auto start = Clock::now();
+        do {
+            for (const auto &f : files)
+                scanned += gsf_load_file(info, f.c_str()).code == 0;
+        } while (millis_since(start) < 1000.0);
+        scan_rate = scanned / millis_since(start) * 1000.0;
+        gsf_delete(info);
+    }
+
+    if (json) {
+        auto j = Json{};
+        j.begin_object();
+        j.field("version", (unsigned long long) gsf_get_version());
+        j.field("scan_files_per_second", scan_rate);
+        j.begin_array("files");
+        for (const auto &r : results) {
+            j.begin_object();
+            j.field("file", r.file.c_str());
+            j.begin_object("load_ms");
+            j.field("cold", r.load_cold_ms);
+            j.field("warm", r.load_warm_ms);
+            j.end_object();
+            j.begin_object("play_emulated_seconds_per_second");
+            for (std::size_t i = 0; i < std::size(r.buffer_sizes); i++)
+                j.field(std::to_string(r.buffer_sizes[i]).c_str(), r.play[i]);
+            j.end_object();
+            j.begin_object("seek_ms");
+            j.field("forward", r.seek_forward_ms);
+            j.field("backward", r.seek_backward_ms);
+            j.end_object();
+            j.begin_object("memory");
+            j.field("peak_bytes", r.peak_bytes);
+            j.field("allocations", r.allocations);
+            j.end_object();
+            j.end_object();
+        }
+        j.end_array();
+        j.end_object();
+        std::printf("%s\n", j.str().c_str());
+        return failed ? 1 : 0;
+    }
+
+    std::printf("%-32s %9s %9s", "file", "cold ms", "warm ms");
+    for (auto size : SuiteResult::buffer_sizes)
+        std::printf(" %8s%-5ld", "play/", size);
+    std::printf(" %10s %10s %10s\n", "fwd seek", "back seek", "peak KiB");
+    for (const auto &r : results) {
+        std::printf("%-32s %9.2f %9.2f", std::filesystem::path(r.file).filename().string().c_str(),
+            r.load_cold_ms, r.load_warm_ms);
+        for (auto x : r.play)
+            std::printf(" %13.1f", x);
+        std::printf(" %10.2f %10.2f %10.0f\n", r.seek_forward_ms, r.seek_backward_ms, double(r.peak_bytes) / 1024);
+    }
+    std::printf("scan: %.0f files/s\n(play in emulated s/s by buffer size, seeks in ms)\n", scan_rate);
+    return failed ? 1 : 0;
+}
+
+// Golden digests: each track rendered for a fixed length in each output
+// mode, hashed, and compared against digests recorded earlier, so that
+// optimizations that change the output by a single sample get caught. The
+// time each render took is recorded too, and a render that got much slower
+// than its recorded time fails as well; times are only comparable on the
+// machine they were recorded on.
+
+constexpr long GOLDEN_SECONDS = 30;
+
+struct GoldenMode {
+    const char *name;
+    int flags;
+};
+
+const GoldenMode golden_modes[] = {
+    { "default", 0 },
+    { "sinc",    GSF_RESAMPLER_SINC },
+    { "native",  GSF_RESAMPLER_NATIVE },
+    { "multi",   GSF_MULTI },
+};
+
+struct Golden {
+    std::string file;       // file name only, so that digests don't depend on paths
+    std::string mode;
+    unsigned long long digest = 0;
+    double ms = 0;
+    long exact_seek_mismatches = 0;
+    long fast_seek_mismatches = 0;
+};
+
+// 64-bit FNV-1a over the samples, as little-endian bytes.
+unsigned long long fnv1a(const short *samples, long n, unsigned long long hash)
+{
+    for (long i = 0; i < n; i++) {
+        auto sample = static_cast<unsigned short>(samples[i]);
+        for (int byte = 0; byte < 2; byte++) {
+            hash ^= (sample >> (byte * 8)) & 0xFF;
+            hash *= 0x100000001b3ull;
+        }
+    }
+    return hash;
+}
+
+// Renders a file from the start, then seeks back to a few points without
+// fast seeking and checks that playing from there gives the same samples.
+bool render_golden(const std::string &path, const GoldenMode &mode, Golden &g)
+{
+    g.file = std::filesystem::path(path).filename().string();
+    g.mode = mode.name;
+    auto *emu = open_file(path.c_str(), mode.flags);
+    if (!emu)
+        return false;
+    gsf_set_infinite(emu, true);
+    long frame = gsf_num_channels(emu);
+    long rate = mode.flags & GSF_RESAMPLER_NATIVE ? 32768 : 44100;
+    auto out = std::vector<short>(GOLDEN_SECONDS * rate * frame);
+    auto start = Clock::now();
+    for (long done = 0; done < long(out.size()); done += 4096 * frame)
+        gsf_play(emu, out.data() + done, std::min<long>(4096 * frame, out.size() - done));
+    g.ms = millis_since(start);
+    g.digest = fnv1a(out.data(), out.size(), 0xcbf29ce484222325ull);
+
+    // seek with the library defaults first (exact), then with fast seeking,
+    // which is allowed to differ and is only reported
+    auto again = std::vector<short>(rate * frame);
+    for (bool fast : { false, true }) {
+        if (fast)
+            gsf_set_fast_seek(emu, true);
+        for (long percent : { 75, 25, 50, 10 }) {
+            long pos = out.size() / frame * percent / 100 * frame;
+            long n = std::min<long>(again.size(), out.size() - pos);
+            gsf_seek_samples(emu, pos);
+            gsf_play(emu, again.data(), n);
+            bool same = std::equal(again.begin(), again.begin() + n, out.begin() + pos);
+            (fast ? g.fast_seek_mismatches : g.exact_seek_mismatches) += !same;
+        }
+    }
+    gsf_delete(emu);
+    return true;
+}
+
+std::vector<Golden> read_goldens(const char *path)
+{
+    auto goldens = std::vector<Golden>{};
+    auto *f = std::fopen(path, "r");
+    if (!f)
+        return goldens;
+    char line[1024], file[512], mode[32];
+    unsigned long long digest;
+    double ms;
+    while (std::fgets(line, sizeof(line), f))
+        if (line[0] != '#' && std::sscanf(line, "%511s %31s %llx %lf", file, mode, &digest, &ms) == 4)
+            goldens.push_back(Golden { file, mode, digest, ms });
+    std::fclose(f);
+    return goldens;
+}
+
+bool write_goldens(const char *path, const std::vector<Golden> &goldens)
+{
+    auto *f = std::fopen(path, "w");
+    if (!f)
+        return false;
+    std::fprintf(f, "# gsf_bench golden: file, mode, digest of the first %ld s, render time in ms\n",
+        GOLDEN_SECONDS);
+    for (const auto &g : goldens)
+        std::fprintf(f, "%s %s %016llx %.1f\n", g.file.c_str(), g.mode.c_str(), g.digest, g.ms);
+    return std::fclose(f) == 0;
+}
+
+int bench_golden(int argc, char *argv[])
+{
+    bool record = false;
+    double tolerance = 1.5;
+    std::string path = GSF_TESTFILES_DIR "/golden.txt";
+    for (; argc > 0 && argv[0][0] == '-'; argc--, argv++) {
+        if (std::strcmp(argv[0], "--record") == 0)
+            record = true;
+        else if (std::strcmp(argv[0], "--golden") == 0 && argc > 1)
+            path = (argc--, *++argv);
+        else if (std::strcmp(argv[0], "--tolerance") == 0 && argc > 1)
+            tolerance = std::atof((argc--, *++argv));
+        else {
+            argc = 0;
+            break;
+        }
+    }
+    auto files = files_or_testfiles(argc, argv);
+    if (files.empty()) {
+        std::fprintf(stderr, "usage: gsf_bench golden [--record] [--golden <file>] [--tolerance <ratio>] [files...]\n");
+        return 1;
+    }
+    auto expected = read_goldens(path.c_str());
+    if (!record && expected.empty()) {
+        // 77 tells ctest to report the test as skipped rather than failed
+        std::fprintf(stderr, "no golden digests in %s; record them with --record\n", path.c_str());
+        return 77;
+    }
+
+    auto results = std::vector<Golden>{};
+    int failed = 0;
+    for (const auto &file : files) {
+        for (const auto &mode : golden_modes) {
+            auto g = Golden{};
+            if (!render_golden(file, mode, g)) {
+                failed++;
+                continue;
+            }
+            const char *status = "ok";
+            char timing[64] = "";
+            auto it = std::find_if(expected.begin(), expected.end(),
+                [&](const Golden &e) { return e.file == g.file && e.mode == g.mode; });
+            if (g.exact_seek_mismatches != 0)
+                status = "SEEK MISMATCH";
+            else if (record)
+                status = "recorded";
+            else if (it == expected.end())
+                status = "NO DIGEST";
+            else if (it->digest != g.digest)
+                status = "DIGEST MISMATCH";
+            else if (g.ms > it->ms * tolerance)
+                status = "SLOWER";
+            if (!record && it != expected.end())
+                std::snprintf(timing, sizeof(timing), " (recorded %.1f ms)", it->ms);
+            failed += std::strcmp(status, "ok") != 0 && std::strcmp(status, "recorded") != 0;
+            std::printf("%-32s %-8s %016llx %9.1f ms%s, fast seeks differ %ld/4: %s\n", g.file.c_str(),
+                g.mode.c_str(), g.digest, g.ms, timing, g.fast_seek_mismatches, status);
+            results.push_back(g);
+        }
+    }
+    if (record && failed != 0) {
+        // digests of a build that seeks wrong or fails to render aren't worth keeping
+        std::fprintf(stderr, "%d renders failed, not writing %s\n", failed, path.c_str());
+        return 1;
+    }
+    if (record && !write_goldens(path.c_str(), results)) {
+        std::fprintf(stderr, "couldn't write %s\n", path.c_str());
+        return 1;
+    }
+    std::printf("%zu renders, %d failed\n", results.size(), failed);
+    return failed ? 1 : 0;
+}
+
+struct Benchmark {
+    const char *name;
+    int (*run)(int argc, char *argv[]);
+    const char *description;
+};
+
+const Benchmark benchmarks[] = {
+    { "seek", bench_seek, "seek latency with and without snapshots and fast seeking" },
+    { "scan", bench_scan, "files per second when reading tags only" },
+    { "play", bench_play, "playback throughput in emulated seconds per second" },
+    { "threads", bench_threads, "how playback throughput scales with threads" },
+    { "chunk", bench_chunk, "cost of gsf_play per sample against buffer size" },
+    { "formats", bench_formats, "cost of each output format per frame" },
+    { "resample", bench_resample, "cost of each resampler against aliasing" },
+    { "load", bench_load, "cold and warm load times with the stdio and mmap readers" },
+    { "reuse", bench_reuse, "per-track setup cost with new, reused and pooled emulators" },
+    { "memory", bench_memory, "memory per emulator with shared and copied roms" },
+    { "budget", bench_budget, "how long budgeted play blocks for, and cost estimates" },
+    { "phases", bench_phases, "time spent in each phase of loading a file" },
+    { "suite", bench_suite, "a bit of everything, as a table or as JSON (--json)" },
+    { "golden", bench_golden, "checks output against recorded digests (--record to record)" },
+};
+
+int main(int argc, char *argv[])
+{
+    if (argc >= 2)
+        for (const auto &b : benchmarks)
+            if (std::strcmp(argv[1], b.name) == 0)
+                return b.run(argc - 2, argv + 2);
+    std::fprintf(stderr, "usage: gsf_bench <benchmark> [args...]\navailable benchmarks:\n");
+    for (const auto &b : benchmarks)
+        std::fprintf(stderr, "    %-10s %s\n", b.name, b.description);
+    return 1;
+}
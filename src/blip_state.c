@@ -0,0 +1,36 @@
+/*
+ * blip_buf keeps its state in a struct private to blip_buf.c, so the library
+ * compiles blip_buf.c through this file instead of on its own, and the
+ * functions below use that struct directly rather than a copy of its layout.
+ */
+
+#include "third-party/blip_buf/blip_buf.c"
+
+#include <string.h>
+#include "blip_state.h"
+
+static size_t total_size(const blip_t *b)
+{
+    return sizeof(*b) + (size_t) (b->size + buf_extra) * sizeof(buf_t);
+}
+
+size_t gsf_blip_used_size(const blip_t *b)
+{
+    const buf_t *buf = SAMPLES(b);
+    size_t n = (size_t) (b->size + buf_extra);
+    while (n > 0 && buf[n-1] == 0)
+        n--;
+    return sizeof(*b) + n * sizeof(buf_t);
+}
+
+void gsf_blip_save(const blip_t *b, void *out, size_t size)
+{
+    memcpy(out, b, size);
+}
+
+void gsf_blip_load(blip_t *b, const void *in, size_t size)
+{
+    size_t total = total_size(b);
+    memcpy(b, in, size);
+    memset((unsigned char *) b + size, 0, total - size);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+/*
+ * Saving and restoring the state of a blip_buf, which mGBA's savestates leave
+ * out. Its struct is private to blip_buf.c, so these are defined in
+ * blip_state.c, which compiles blip_buf.c itself.
+ */
+
+#include <stddef.h>
+#include <mgba/core/blip_buf.h>
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/* Size of the state without the trailing zeroes of its sample buffer, which
+ * is usually much smaller than the whole of it. */
+size_t gsf_blip_used_size(const blip_t *b);
+
+/* Copies the first `size` bytes of the state, as given by gsf_blip_used_size. */
+void gsf_blip_save(const blip_t *b, void *out, size_t size);
+
+/* Restores a state saved by gsf_blip_save from a blip_buf of the same size,
+ * zeroing the rest of the sample buffer. */
+void gsf_blip_load(blip_t *b, const void *in, size_t size);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,330 @@
+#pragma once
+
+#include <cstddef>
+
+#if !defined(GSF_NO_SIMD)
+    #if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+        #define GSF_SSE2 1
+        #include <emmintrin.h>
+        #if defined(__GNUC__)
+            #define GSF_AVX2 1
+            #include <immintrin.h>
+        #endif
+    #elif defined(__ARM_NEON) || defined(__ARM_NEON__) || defined(_M_ARM64)
+        #define GSF_NEON 1
+        #include <arm_neon.h>
+    #endif
+#endif
+
+/*
+ * Kernels converting the 16-bit samples we get from blip_buf into the other
+ * output formats, plus the inner loop of the sinc resampler. SSE2 and NEON are
+ * picked at compile time, since they're always there on the architectures
+ * that have them; AVX2 is picked at runtime when the CPU supports it. Define
+ * GSF_NO_SIMD to use the scalar versions only. Only stereo gets vectorized
+ * layout changes: GSF_MULTI's 12 channels are rare enough that the scalar
+ * loops are fine for them.
+ */
+namespace convert {
+
+constexpr float S16_SCALE = 1.0f / 32768.0f;
+
+namespace scalar {
+
+inline void to_f32(const short *in, float *out, std::size_t n)
+{
+    for (std::size_t i = 0; i < n; i++)
+        out[i] = in[i] * S16_SCALE;
+}
+
+inline void deinterleave_stereo(const short *in, float *left, float *right, std::size_t frames)
+{
+    for (std::size_t i = 0; i < frames; i++) {
+        left[i]  = in[i*2  ] * S16_SCALE;
+        right[i] = in[i*2+1] * S16_SCALE;
+    }
+}
+
+inline void downmix_stereo(const short *in, float *out, std::size_t frames)
+{
+    for (std::size_t i = 0; i < frames; i++)
+        out[i] = (in[i*2] + in[i*2+1]) * (S16_SCALE * 0.5f);
+}
+
+inline void dot2(const float *x, const float *a, const float *b, std::size_t n, float &ra, float &rb)
+{
+    float sa = 0.0f, sb = 0.0f;
+    for (std::size_t i = 0; i < n; i++) {
+        sa += x[i] * a[i];
+        sb += x[i] * b[i];
+    }
+    ra = sa;
+    rb = sb;
+}
+
+} // namespace scalar
+
+#ifdef GSF_SSE2
+namespace sse2 {
+
+inline void to_f32(const short *in, float *out, std::size_t n)
+{
+    const auto scale = _mm_set1_ps(S16_SCALE);
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto v  = _mm_loadu_si128((const __m128i *) (in + i));
+        // sign extend by putting each sample in the top half and shifting down
+        auto lo = _mm_srai_epi32(_mm_unpacklo_epi16(v, v), 16);
+        auto hi = _mm_srai_epi32(_mm_unpackhi_epi16(v, v), 16);
+        _mm_storeu_ps(out + i,     _mm_mul_ps(_mm_cvtepi32_ps(lo), scale));
+        _mm_storeu_ps(out + i + 4, _mm_mul_ps(_mm_cvtepi32_ps(hi), scale));
+    }
+    scalar::to_f32(in + i, out + i, n - i);
+}
+
+inline void deinterleave_stereo(const short *in, float *left, float *right, std::size_t frames)
+{
+    const auto scale = _mm_set1_ps(S16_SCALE);
+    std::size_t i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        auto v = _mm_loadu_si128((const __m128i *) (in + i*2));
+        auto l = _mm_srai_epi32(_mm_slli_epi32(v, 16), 16);
+        auto r = _mm_srai_epi32(v, 16);
+        _mm_storeu_ps(left  + i, _mm_mul_ps(_mm_cvtepi32_ps(l), scale));
+        _mm_storeu_ps(right + i, _mm_mul_ps(_mm_cvtepi32_ps(r), scale));
+    }
+    scalar::deinterleave_stereo(in + i*2, left + i, right + i, frames - i);
+}
+
+inline void downmix_stereo(const short *in, float *out, std::size_t frames)
+{
+    const auto scale = _mm_set1_ps(S16_SCALE * 0.5f);
+    const auto ones  = _mm_set1_epi16(1);
+    std::size_t i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        auto v   = _mm_loadu_si128((const __m128i *) (in + i*2));
+        auto sum = _mm_madd_epi16(v, ones);
+        _mm_storeu_ps(out + i, _mm_mul_ps(_mm_cvtepi32_ps(sum), scale));
+    }
+    scalar::downmix_stereo(in + i*2, out + i, frames - i);
+}
+
+inline float hsum(__m128 v)
+{
+    v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+    v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+    return _mm_cvtss_f32(v);
+}
+
+// `n` must be a multiple of 4.
+inline void dot2(const float *x, const float *a, const float *b, std::size_t n, float &ra, float &rb)
+{
+    auto sa = _mm_setzero_ps(), sb = _mm_setzero_ps();
+    for (std::size_t i = 0; i < n; i += 4) {
+        auto v = _mm_loadu_ps(x + i);
+        sa = _mm_add_ps(sa, _mm_mul_ps(v, _mm_loadu_ps(a + i)));
+        sb = _mm_add_ps(sb, _mm_mul_ps(v, _mm_loadu_ps(b + i)));
+    }
+    ra = hsum(sa);
+    rb = hsum(sb);
+}
+
+} // namespace sse2
+#endif
+
+#ifdef GSF_AVX2
+namespace avx2 {
+
+__attribute__((target("avx2")))
+inline void to_f32(const short *in, float *out, std::size_t n)
+{
+    const auto scale = _mm256_set1_ps(S16_SCALE);
+    std::size_t i = 0;
+    for (; i + 16 <= n; i += 16) {
+        auto lo = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (in + i)));
+        auto hi = _mm256_cvtepi16_epi32(_mm_loadu_si128((const __m128i *) (in + i + 8)));
+        _mm256_storeu_ps(out + i,     _mm256_mul_ps(_mm256_cvtepi32_ps(lo), scale));
+        _mm256_storeu_ps(out + i + 8, _mm256_mul_ps(_mm256_cvtepi32_ps(hi), scale));
+    }
+    sse2::to_f32(in + i, out + i, n - i);
+}
+
+__attribute__((target("avx2")))
+inline void deinterleave_stereo(const short *in, float *left, float *right, std::size_t frames)
+{
+    const auto scale = _mm256_set1_ps(S16_SCALE);
+    std::size_t i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        auto v = _mm256_loadu_si256((const __m256i *) (in + i*2));
+        auto l = _mm256_srai_epi32(_mm256_slli_epi32(v, 16), 16);
+        auto r = _mm256_srai_epi32(v, 16);
+        _mm256_storeu_ps(left  + i, _mm256_mul_ps(_mm256_cvtepi32_ps(l), scale));
+        _mm256_storeu_ps(right + i, _mm256_mul_ps(_mm256_cvtepi32_ps(r), scale));
+    }
+    sse2::deinterleave_stereo(in + i*2, left + i, right + i, frames - i);
+}
+
+__attribute__((target("avx2")))
+inline void downmix_stereo(const short *in, float *out, std::size_t frames)
+{
+    const auto scale = _mm256_set1_ps(S16_SCALE * 0.5f);
+    const auto ones  = _mm256_set1_epi16(1);
+    std::size_t i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        auto v   = _mm256_loadu_si256((const __m256i *) (in + i*2));
+        auto sum = _mm256_madd_epi16(v, ones);
+        _mm256_storeu_ps(out + i, _mm256_mul_ps(_mm256_cvtepi32_ps(sum), scale));
+    }
+    sse2::downmix_stereo(in + i*2, out + i, frames - i);
+}
+
+// `n` must be a multiple of 8.
+__attribute__((target("avx2")))
+inline void dot2(const float *x, const float *a, const float *b, std::size_t n, float &ra, float &rb)
+{
+    auto sa = _mm256_setzero_ps(), sb = _mm256_setzero_ps();
+    for (std::size_t i = 0; i < n; i += 8) {
+        auto v = _mm256_loadu_ps(x + i);
+        sa = _mm256_add_ps(sa, _mm256_mul_ps(v, _mm256_loadu_ps(a + i)));
+        sb = _mm256_add_ps(sb, _mm256_mul_ps(v, _mm256_loadu_ps(b + i)));
+    }
+    ra = sse2::hsum(_mm_add_ps(_mm256_castps256_ps128(sa), _mm256_extractf128_ps(sa, 1)));
+    rb = sse2::hsum(_mm_add_ps(_mm256_castps256_ps128(sb), _mm256_extractf128_ps(sb, 1)));
+}
+
+inline bool supported()
+{
+    __builtin_cpu_init();
+    return __builtin_cpu_supports("avx2");
+}
+
+} // namespace avx2
+#endif
+
+#ifdef GSF_NEON
+namespace neon {
+
+inline void to_f32(const short *in, float *out, std::size_t n)
+{
+    std::size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        auto v = vld1q_s16(in + i);
+        vst1q_f32(out + i,     vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v))),  S16_SCALE));
+        vst1q_f32(out + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v))), S16_SCALE));
+    }
+    scalar::to_f32(in + i, out + i, n - i);
+}
+
+inline void deinterleave_stereo(const short *in, float *left, float *right, std::size_t frames)
+{
+    std::size_t i = 0;
+    for (; i + 8 <= frames; i += 8) {
+        auto v = vld2q_s16(in + i*2);
+        vst1q_f32(left  + i,     vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v.val[0]))),  S16_SCALE));
+        vst1q_f32(left  + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v.val[0]))), S16_SCALE));
+        vst1q_f32(right + i,     vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_low_s16(v.val[1]))),  S16_SCALE));
+        vst1q_f32(right + i + 4, vmulq_n_f32(vcvtq_f32_s32(vmovl_s16(vget_high_s16(v.val[1]))), S16_SCALE));
+    }
+    scalar::deinterleave_stereo(in + i*2, left + i, right + i, frames - i);
+}
+
+inline void downmix_stereo(const short *in, float *out, std::size_t frames)
+{
+    std::size_t i = 0;
+    for (; i + 4 <= frames; i += 4) {
+        auto sum = vpaddlq_s16(vld1q_s16(in + i*2));
+        vst1q_f32(out + i, vmulq_n_f32(vcvtq_f32_s32(sum), S16_SCALE * 0.5f));
+    }
+    scalar::downmix_stereo(in + i*2, out + i, frames - i);
+}
+
+// `n` must be a multiple of 4.
+inline void dot2(const float *x, const float *a, const float *b, std::size_t n, float &ra, float &rb)
+{
+    auto sa = vdupq_n_f32(0.0f), sb = vdupq_n_f32(0.0f);
+    for (std::size_t i = 0; i < n; i += 4) {
+        auto v = vld1q_f32(x + i);
+        sa = vmlaq_f32(sa, v, vld1q_f32(a + i));
+        sb = vmlaq_f32(sb, v, vld1q_f32(b + i));
+    }
+    auto pa = vadd_f32(vget_low_f32(sa), vget_high_f32(sa));
+    auto pb = vadd_f32(vget_low_f32(sb), vget_high_f32(sb));
+    ra = vget_lane_f32(vpadd_f32(pa, pa), 0);
+    rb = vget_lane_f32(vpadd_f32(pb, pb), 0);
+}
+
+} // namespace neon
+#endif
+
+struct Kernels {
+    void (*to_f32)(const short *in, float *out, std::size_t n);
+    void (*deinterleave_stereo)(const short *in, float *left, float *right, std::size_t frames);
+    void (*downmix_stereo)(const short *in, float *out, std::size_t frames);
+    // dot products of `x` with both `a` and `b`, for the sinc resampler;
+    // `n` must be a multiple of 8
+    void (*dot2)(const float *x, const float *a, const float *b, std::size_t n, float &ra, float &rb);
+};
+
+inline Kernels select_kernels()
+{
+#if defined(GSF_AVX2)
+    if (avx2::supported())
+        return { avx2::to_f32, avx2::deinterleave_stereo, avx2::downmix_stereo, avx2::dot2 };
+#endif
+#if defined(GSF_SSE2)
+    return { sse2::to_f32, sse2::deinterleave_stereo, sse2::downmix_stereo, sse2::dot2 };
+#elif defined(GSF_NEON)
+    return { neon::to_f32, neon::deinterleave_stereo, neon::downmix_stereo, neon::dot2 };
+#else
+    return { scalar::to_f32, scalar::deinterleave_stereo, scalar::downmix_stereo, scalar::dot2 };
+#endif
+}
+
+inline const Kernels &kernels()
+{
+    static const Kernels k = select_kernels();
+    return k;
+}
+
+/* Converts `n` interleaved samples to floats in [-1, 1). */
+inline void to_f32(const short *in, float *out, std::size_t n)
+{
+    kernels().to_f32(in, out, n);
+}
+
+/*
+ * Converts `frames` frames of `channels` interleaved samples to floats,
+ * writing each channel to its own buffer in `out` starting at `offset`.
+ */
+inline void to_planar_f32(const short *in, float *const *out, std::size_t offset,
+    int channels, std::size_t frames)
+{
+    if (channels == 2) {
+        kernels().deinterleave_stereo(in, out[0] + offset, out[1] + offset, frames);
+        return;
+    }
+    for (std::size_t i = 0; i < frames; i++)
+        for (int c = 0; c < channels; c++)
+            out[c][offset + i] = in[i * channels + c] * S16_SCALE;
+}
+
+/*
+ * Downmixes `frames` frames of `channels` interleaved samples to mono floats.
+ * Channels are taken to be left/right pairs that add up to a stereo mix (as
+ * with GSF_MULTI), and mono is the average of its left and right.
+ */
+inline void to_mono_f32(const short *in, float *out, int channels, std::size_t frames)
+{
+    if (channels == 2) {
+        kernels().downmix_stereo(in, out, frames);
+        return;
+    }
+    for (std::size_t i = 0; i < frames; i++) {
+        int sum = 0;
+        for (int c = 0; c < channels; c++)
+            sum += in[i * channels + c];
+        out[i] = sum * (S16_SCALE * 0.5f);
+    }
+}
+
+} // namespace convert
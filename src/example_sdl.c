@@ -106,27 +106,15 @@ bool get_input(char *c)
 
 #endif
 
-// note that using SDL's audio libraries with a small buffer size
-// can result in garbage being played alongside the music.
-// if you wanna test it, simply set the value below to 16
+// the player emulates on its own thread, so the callback only copies samples
+// and SDL's buffer can be small
 #define NUM_SAMPLES 1024
 #define NUM_CHANNELS 2
-#define BUF_SIZE 2048
 
 void sdl_callback(void *userdata, unsigned char *stream, int length)
 {
-    GsfEmu *emu = (GsfEmu *) userdata;
-    memset(stream, 0, length);
-    if (!gsf_ended(emu)) {
-        short samples[BUF_SIZE];
-        gsf_play(emu, samples, BUF_SIZE);
-        memcpy(stream, samples, sizeof(samples));
-    }
-    printf("\r%d samples, %d millis, %d seconds",
-        gsf_tell_samples(emu),
-        gsf_tell(emu),
-        gsf_tell(emu) / 1000);
-    fflush(stdout);
+    GsfPlayer *player = (GsfPlayer *) userdata;
+    gsf_player_read(player, (short *) stream, length / sizeof(short));
 }
 
 int main(int argc, char *argv[])
@@ -168,6 +156,12 @@ int main(int argc, char *argv[])
     printf("length: %d ms\n", gsf_length(emu));
     gsf_free_tags(tags);
 
+    GsfPlayer *player;
+    if (gsf_player_new(&player, emu, NULL).code != 0) {
+        printf("couldn't start player\n");
+        return 1;
+    }
+
     term_init();
 
     SDL_Init(SDL_INIT_AUDIO);
@@ -176,7 +170,7 @@ int main(int argc, char *argv[])
     spec.format   = AUDIO_S16SYS;
     spec.channels = NUM_CHANNELS;
     spec.samples  = NUM_SAMPLES;
-    spec.userdata = emu;
+    spec.userdata = player;
     spec.callback = sdl_callback;
     int dev = SDL_OpenAudioDevice(NULL, 0, &spec, &spec, 0);
 
@@ -193,27 +187,27 @@ int main(int argc, char *argv[])
         char c = 1;
         if (get_input(&c)) {
             switch (c) {
-            case 'l': {
-                SDL_LockAudioDevice(dev);
-                GsfError err = gsf_seek(emu, gsf_tell(emu) + 1000);
-                if (err.code != 0)
-                    printf("seek error: %d, %d\n", err.code, err.from);
-                SDL_UnlockAudioDevice(dev);
+            case 'l':
+                gsf_player_seek(player, gsf_player_tell(player) + 1000);
                 break;
-            }
-            case 'h': {
-                SDL_LockAudioDevice(dev);
-                GsfError err = gsf_seek(emu, gsf_tell(emu) - 1000);
-                if (err.code != 0)
-                    printf("seek error: %d, %d\n", err.code, err.from);
-                SDL_UnlockAudioDevice(dev);
+            case 'h':
+                gsf_player_seek(player, gsf_player_tell(player) - 1000);
                 break;
             }
-            }
         }
+        GsfPlayerStats stats;
+        gsf_player_get_stats(player, &stats);
+        printf("\r%ld samples, %ld millis, %ld seconds, %lu underruns",
+            gsf_player_tell_samples(player),
+            gsf_player_tell(player),
+            gsf_player_tell(player) / 1000,
+            stats.underruns);
+        fflush(stdout);
+        SDL_Delay(10);
     }
 
     SDL_CloseAudioDevice(dev);
+    gsf_player_delete(player);
     gsf_delete(emu);
 
     term_end();
@@ -5,7 +5,11 @@
 #include <cstdint>
 #include <cstring>
 #include <cmath>
+#include <cerrno>
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cassert>
 #include <limits>
 #include <span>
 #include <array>
@@ -19,14 +23,34 @@
 #include <optional>
 #include <bit>
 #include <system_error>
+#include <list>
+#include <memory>
+#include <mutex>
+#include <numbers>
+#include <thread>
 #include <zlib.h>
 #include <tl/expected.hpp>
 #include <mgba/gba/core.h>
 #include <mgba/core/core.h>
 #include <mgba/core/blip_buf.h>
 #include <mgba/core/log.h>
+// The only internal header used, and only here: GSF_MULTI samples the voices
+// from GBA::audio (its PSG, FIFOs, mixer settings and sample event), the
+// idle loop overrides set GBA::idleLoop and GBA::idleOptimization, and
+// NullRenderer is attached through GBA::video.
+#include <mgba/internal/gba/gba.h>
 #include <mgba-util/vfs.h>
+#if defined(GSF_USE_MMAP) || defined(GSF_SHARE_ROMS)
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
 #include "allocation.hpp"
+#include "blip_state.h"
+#include "convert.hpp"
+#include "pool.hpp"
+#include "trace.hpp"
 #include "string.hpp"
 
 
@@ -37,6 +61,7 @@ namespace fs = std::filesystem;
 
 using u8 = unsigned char;
 using u32 = uint32_t;
+using u64 = uint64_t;
 template <typename T> using Vector = std::vector<T, GsfAllocator<T>>;
 using String = std::basic_string<char, std::char_traits<char>, GsfAllocator<char>>;
 template <typename T> using Result = tl::expected<T, GsfError>;
@@ -63,32 +88,34 @@ u32 read4(T ptr)
     return ptr[0] | (ptr[1] << 8) | (ptr[2] << 16) | (ptr[3] << 24);
 }
 
+// Parses a duration in the format [[hh:]mm:]ss[.sss] (with either a dot or a
+// comma before the decimals) to milliseconds.
 std::optional<int> parse_duration(std::string_view s)
 {
-    if (s.size() == 0)
-        return std::nullopt;
-    std::array<int, 4> numbers = { 0, 0, 0, 0 };
-    std::array<int, 4> multipliers = { 60 * 60 * 1000, 60 * 1000, 1000, 1 };
-    auto parsenum = [&] (auto start, int index) {
-        auto i = start;
-        while (string::is_digit(s[i]))
-            i--;
-        numbers[index--] = string::to_number(s.substr(i+1, start - i)).value();
-        return i;
+    auto digits = [](std::string_view n) {
+        return n.size() > 0 && std::all_of(n.begin(), n.end(), string::is_digit);
     };
-    int i = parsenum(s.size() - 1, 3);
-    if (s[i] == '.' || s[i] == ',')
-        i = parsenum(i-1, 2);
-    if (s[i] == ':')
-        i = parsenum(i-1, 1);
-    if (s[i] == ':')
-        i = parsenum(i-1, 0);
-    if (i > 0)
+    int millis = 0;
+    if (auto sep = s.find_first_of(".,"); sep != s.npos) {
+        // anything past milliseconds is too precise to matter
+        auto decimals = s.substr(sep + 1, 3);
+        if (!digits(s.substr(sep + 1)))
+            return std::nullopt;
+        millis = string::to_number<int>(decimals).value();
+        for (auto i = decimals.size(); i < 3; i++)
+            millis *= 10;
+        s = s.substr(0, sep);
+    }
+    int secs = 0, parts = 0;
+    bool valid = true;
+    string::split(s, ':', [&](std::string_view part) {
+        valid = valid && digits(part) && ++parts <= 3;
+        if (valid)
+            secs = secs * 60 + string::to_number<int>(part).value();
+    });
+    if (!valid || parts == 0)
         return std::nullopt;
-    int n = 0;
-    for (int i = 0; i < 4; i++)
-        n += numbers[i] * multipliers[i];
-    return n;
+    return secs * 1000 + millis;
 }
 
 constexpr long samples_to_millis(long samples, int sample_rate, int channels)
@@ -120,21 +147,29 @@ struct ManagedBuffer {
     std::span<const T> to_span() const { return std::span<T>(ptr.get(), size); }
 };
 
+// Deletes file data through a user-supplied function, such as
+// GsfReader::delete_data. A null function means the data isn't ours to delete.
 struct Deleter {
-    GsfReader reader;
-    const GsfAllocators allocators;
+    void (*fn)(unsigned char *buf, long size, void *userdata, const GsfAllocators *allocators);
+    void *userdata;
+    GsfAllocators allocators;
     long size;
-    void operator()(unsigned char *buf) { reader.delete_data(buf, size, reader.userdata, &allocators); }
+    void operator()(unsigned char *buf) { if (fn) fn(buf, size, userdata, &allocators); }
 };
 
-GsfReadResult default_read_file(const char *filename, void *, const GsfAllocators *allocators)
+GsfReadResult default_read_range(const char *filename, long offset, long size, void *,
+    const GsfAllocators *allocators)
 {
     FILE *file = std::fopen(filename, "rb");
     if (!file)
         return { .buf = nullptr, .size = 0, .err = { .code = errno, .from = 0 } };
     std::fseek(file, 0l, SEEK_END);
-    auto size = std::ftell(file);
-    std::rewind(file);
+    size = std::clamp(std::ftell(file) - offset, 0l, size);
+    if (size == 0) {
+        std::fclose(file);
+        return { .buf = nullptr, .size = 0, .err = { .code = 0, .from = 0 } };
+    }
+    std::fseek(file, offset, SEEK_SET);
     unsigned char *buf = allocate<unsigned char>(*allocators, size);
     if (!buf) {
         std::fclose(file);
@@ -151,81 +186,235 @@ GsfReadResult default_read_file(const char *filename, void *, const GsfAllocator
     return { .buf = buf, .size = size, .err = { .code = 0, .from = 0 } };
 }
 
+GsfReadResult default_read_file(const char *filename, void *userdata, const GsfAllocators *allocators)
+{
+    return default_read_range(filename, 0, std::numeric_limits<long>::max(), userdata, allocators);
+}
+
 void default_delete_data(unsigned char *buf, long size, void *, const GsfAllocators *allocators)
 {
     allocators->free(buf, size, allocators->userdata);
 }
 
-Result<ManagedBuffer<u8, Deleter>> read_file(fs::path filepath,
+#ifdef GSF_USE_MMAP
+
+// Maps files read-only instead of reading them. Mappings must start at a page
+// boundary, so for ranges we map from the start of the page and hand back a
+// pointer inside it; delete_data then finds the start of the page again.
+GsfReadResult mmap_read_range(const char *filename, long offset, long size, void *, const GsfAllocators *)
+{
+    int fd = ::open(filename, O_RDONLY | O_CLOEXEC);
+    if (fd < 0)
+        return { .buf = nullptr, .size = 0, .err = { .code = errno, .from = 0 } };
+    struct stat st;
+    if (::fstat(fd, &st) < 0) {
+        auto err = errno;
+        ::close(fd);
+        return { .buf = nullptr, .size = 0, .err = { .code = err, .from = 0 } };
+    }
+    size = std::clamp(long(st.st_size) - offset, 0l, size);
+    if (size == 0) {
+        ::close(fd);
+        return { .buf = nullptr, .size = 0, .err = { .code = 0, .from = 0 } };
+    }
+    auto start = offset - offset % ::sysconf(_SC_PAGESIZE);
+    auto length = std::size_t(size + offset - start);
+    void *p = ::mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, start);
+    auto err = errno;
+    ::close(fd);
+    if (p == MAP_FAILED)
+        return { .buf = nullptr, .size = 0, .err = { .code = err, .from = 0 } };
+    ::madvise(p, length, MADV_SEQUENTIAL);
+    return { .buf = static_cast<u8 *>(p) + (offset - start), .size = size, .err = { .code = 0, .from = 0 } };
+}
+
+GsfReadResult mmap_read_file(const char *filename, void *userdata, const GsfAllocators *allocators)
+{
+    return mmap_read_range(filename, 0, std::numeric_limits<long>::max(), userdata, allocators);
+}
+
+void mmap_delete_data(unsigned char *buf, long size, void *, const GsfAllocators *)
+{
+    auto addr = reinterpret_cast<uintptr_t>(buf);
+    auto start = addr - addr % ::sysconf(_SC_PAGESIZE);
+    ::munmap(reinterpret_cast<void *>(start), size + (addr - start));
+}
+
+const GsfReader mmap_reader = { mmap_read_file, mmap_delete_data, nullptr };
+
+#endif
+
+const GsfReader stdio_reader = { default_read_file, default_delete_data, nullptr };
+
+GsfReader default_reader()
+{
+#ifdef GSF_USE_MMAP
+    return mmap_reader;
+#else
+    return stdio_reader;
+#endif
+}
+
+// Whether a reader reads from the filesystem, i.e. it's one of ours.
+bool reads_filesystem(const GsfReader &reader)
+{
+#ifdef GSF_USE_MMAP
+    if (reader.read == mmap_read_file)
+        return true;
+#endif
+    return reader.read == default_read_file;
+}
+
+// Pairs a reader with the range reading function of the matching reader of
+// ours, if it's one of them.
+GsfRangeReader with_range(const GsfReader &reader)
+{
+#ifdef GSF_USE_MMAP
+    if (reader.read == mmap_read_file)
+        return { reader, mmap_read_range };
+#endif
+    return { reader, reader.read == default_read_file ? default_read_range : nullptr };
+}
+
+Result<ManagedBuffer<u8, Deleter>> to_buffer(GsfReadResult res,
     const GsfReader &reader, const GsfAllocators &allocators)
 {
-    auto res = reader.read(filepath.string().c_str(), reader.userdata, &allocators);
     if (res.err.code != 0)
         return tl::unexpected(res.err);
-    auto deleter = Deleter { .reader = reader, .allocators = allocators, .size = res.size };
+    trace::count_read(res.size);
+    auto deleter = Deleter {
+        .fn = reader.delete_data, .userdata = reader.userdata, .allocators = allocators, .size = res.size
+    };
     return ManagedBuffer {
         .ptr = std::unique_ptr<u8[], Deleter>{res.buf, deleter},
         .size = std::size_t(res.size),
     };
 }
 
+Result<ManagedBuffer<u8, Deleter>> read_file(fs::path filepath,
+    const GsfReader &reader, const GsfAllocators &allocators)
+{
+    trace::Timed timed{GSF_TRACE_READ};
+    return to_buffer(reader.read(filepath.string().c_str(), reader.userdata, &allocators),
+                     reader, allocators);
+}
+
+Result<ManagedBuffer<u8, Deleter>> read_file_range(fs::path filepath, long offset, long size,
+    const GsfRangeReader &reader, const GsfAllocators &allocators)
+{
+    trace::Timed timed{GSF_TRACE_READ};
+    return to_buffer(reader.read_range(filepath.string().c_str(), offset, size, reader.reader.userdata,
+                                       &allocators),
+                     reader.reader, allocators);
+}
+
 
 
 /* gsf parsing */
 
+#include "rom.hpp"
+
 struct Rom {
     u32 entry_point;
     u32 offset;
-    Vector<u8> data;
+    RomImage data;
+    // set instead of `data` for cached libraries, if sharing roms is supported
+    std::shared_ptr<const SharedRom> shared;
 
     explicit Rom(const GsfAllocators &allocators)
-        : entry_point{0}, offset{0}, data(GsfAllocator<u8>(allocators))
-    { }
-    Rom(u32 entry_point, u32 offset, Vector<u8> data)
-        : entry_point{entry_point}, offset{offset}, data{std::move(data)}
+        : entry_point{0}, offset{0}, data(allocators)
     { }
+
+    std::span<const u8> bytes() const { return shared ? shared->bytes() : data.bytes(); }
 };
 
 struct GSFFile {
     // std::span<u8> reserved;
+    std::span<const u8> program; // compressed, points inside the file's data
+    u32 crc = 0;
     Rom rom;
     TagMap tags;
 
     GSFFile(const GsfAllocators &allocators)
         : rom{allocators}, tags(GsfAllocator<std::pair<const String, String>>(allocators))
     { }
-    GSFFile(Rom &&rom, TagMap &&tags)
-        : rom{std::move(rom)}, tags{std::move(tags)}
+    GSFFile(std::span<const u8> program, u32 crc, Rom &&rom, TagMap &&tags)
+        : program{program}, crc{crc}, rom{std::move(rom)}, tags{std::move(tags)}
     { }
-
-    void impose(const GSFFile &f)
-    {
-        std::copy(f.rom.data.begin(), f.rom.data.end(),
-                    rom.data.begin() + (f.rom.offset & 0x01FFFFFF));
-    }
 };
 
-Result<Rom> uncompress_rom(std::span<u8> data, u32 crc, const GsfAllocators &allocators)
+// Uncompresses a program section in a single pass: the 12 byte header (entry
+// point, offset and size of the rom) is taken from the first bytes of output,
+// then the rom is written straight into `out`, either at its offset (growing
+// `out` as needed) or at its start if `at_offset` isn't set. The CRC is
+// computed on the input as it's fed to zlib.
+Result<ProgramHeader> uncompress_program(std::span<const u8> data, u32 crc, RomImage &out,
+    bool at_offset)
 {
-    if (crc != crc32(crc32(0l, nullptr, 0), data.data(), data.size()))
-        return tl::unexpected(make_err(GSF_INVALID_CRC));
-    // uncompress first 12 bytes first, which tells us the entry point,
-    // the offset and the size of the rom
+    constexpr std::size_t CHUNK_SIZE = 64 * 1024;
+    trace::Timed timed{GSF_TRACE_INFLATE};
+    z_stream stream = {};
+    if (inflateInit(&stream) != Z_OK)
+        return tl::unexpected(make_err(GSF_ALLOCATION_FAILED));
     std::array<u8, 12> tmp;
-    unsigned long size = 12;
-    if (uncompress(tmp.data(), &size, data.data(), data.size()) != Z_BUF_ERROR)
-        return tl::unexpected(make_err(GSF_UNCOMPRESS_ERROR));
-    // re-uncompress, now with the real size;
-    size = read4(&tmp[8]) + 12;
-    auto uncompressed = Vector<u8>(size, 0, GsfAllocator<u8>(allocators));
-    if (uncompress(uncompressed.data(), &size, data.data(), data.size()) != Z_OK)
-        return tl::unexpected(make_err(GSF_UNCOMPRESS_ERROR));
-    uncompressed.erase(uncompressed.begin(), uncompressed.begin() + 12);
-    return Rom {
-        read4(&tmp[0]),
-        read4(&tmp[4]),
-        std::move(uncompressed)
+    stream.next_out  = tmp.data();
+    stream.avail_out = tmp.size();
+    auto header = std::optional<ProgramHeader>{};
+    auto computed = crc32(0l, nullptr, 0);
+    std::size_t fed = 0;
+    auto feed = [&] (std::size_t size) {
+        computed = crc32(computed, data.data() + fed, size);
+        stream.next_in  = const_cast<u8 *>(data.data() + fed);
+        stream.avail_in = size;
+        fed += size;
     };
+    auto err = GsfErrorCode{};
+    for (auto ret = Z_OK; ret != Z_STREAM_END; ) {
+        if (stream.avail_in == 0 && fed < data.size())
+            feed(std::min(CHUNK_SIZE, data.size() - fed));
+        if (!header && stream.avail_out == 0) {
+            header = ProgramHeader { read4(&tmp[0]), read4(&tmp[4]), read4(&tmp[8]) };
+            auto start = at_offset ? header->offset & ROM_MASK : 0;
+            if (std::size_t(start) + header->size > ROM_MASK + 1) {
+                err = GSF_INVALID_SECTION_LENGTH;
+                break;
+            }
+            if (out.size() < start + header->size)
+                out.resize(start + header->size);
+            stream.next_out  = out.data() + start;
+            stream.avail_out = header->size;
+        }
+        ret = inflate(&stream, Z_NO_FLUSH);
+        if (ret != Z_OK && ret != Z_STREAM_END) {
+            err = ret == Z_MEM_ERROR ? GSF_ALLOCATION_FAILED : GSF_UNCOMPRESS_ERROR;
+            break;
+        }
+    }
+    inflateEnd(&stream);
+    // a bad CRC is a better explanation for any other error
+    feed(data.size() - fed);
+    if (computed != crc)
+        return tl::unexpected(make_err(GSF_INVALID_CRC));
+    if (err != 0)
+        return tl::unexpected(make_err(err));
+    if (!header)
+        return tl::unexpected(make_err(GSF_UNCOMPRESS_ERROR));
+    trace::count_inflated(header->size);
+    return header.value();
+}
+
+// Superimposes the rom of a file on top of a rom image, growing it as needed.
+Result<void> impose(RomImage &image, const GSFFile &f)
+{
+    if (!f.program.empty())
+        return uncompress_program(f.program, f.crc, image, true).map([] (ProgramHeader) { });
+    trace::Timed timed{GSF_TRACE_IMPOSE};
+    auto start = f.rom.offset & ROM_MASK;
+    auto bytes = f.rom.bytes();
+    if (image.size() < start + bytes.size())
+        image.resize(start + bytes.size());
+    std::copy(bytes.begin(), bytes.end(), image.data() + start);
+    return {};
 }
 
 TagMap parse_tags(std::string_view tags, const GsfAllocators &allocators)
@@ -246,74 +435,402 @@ TagMap parse_tags(std::string_view tags, const GsfAllocators &allocators)
     return result;
 }
 
-Result<GSFFile> parse(std::span<u8> data, const GsfAllocators &allocators)
+struct FileHeader {
+    u32 reserved_length;
+    u32 program_length;
+    u32 crc;
+
+    std::size_t tags_offset() const { return std::size_t(16) + reserved_length + program_length; }
+};
+
+constexpr std::size_t HEADER_SIZE   = 0x10;
+constexpr std::size_t MAX_FILE_SIZE = 0x4000000;
+constexpr std::size_t MAX_TAGS_SIZE = 5 + 50000;
+
+Result<FileHeader> parse_header(std::span<const u8> data)
 {
-    if (data.size() < 0x10 || data.size() > 0x4000000)
+    if (data.size() < HEADER_SIZE)
         return tl::unexpected(make_err(GSF_INVALID_FILE_SIZE));
     if (data[0] != 'P' || data[1] != 'S' || data[2] != 'F' || data[3] != 0x22)
         return tl::unexpected(make_err(GSF_INVALID_HEADER));
-    size_t cursor = 4;
-    auto readb = [&](size_t bytes) { auto p = &data[cursor]; cursor += bytes; return std::span{p, bytes}; };
-    u32 reserved_length = read4(readb(4));
-    u32 program_length  = read4(readb(4));
-    u32 crc             = read4(readb(4));
-    if (reserved_length + program_length + 16 > data.size())
+    return FileHeader {
+        .reserved_length = read4(data.subspan(4, 4)),
+        .program_length  = read4(data.subspan(8, 4)),
+        .crc             = read4(data.subspan(12, 4)),
+    };
+}
+
+// Parses the tags section, i.e. whatever comes after the program section.
+TagMap parse_tags_section(std::span<const u8> data, const GsfAllocators &allocators)
+{
+    auto tags = data.size() > 5 && std::memcmp(data.data(), "[TAG]", 5) == 0
+              ? data.subspan(5, std::min<size_t>(data.size() - 5, MAX_TAGS_SIZE - 5))
+              : std::span<const u8>{};
+    return parse_tags(std::string_view((const char *) tags.data(), tags.size()), allocators);
+}
+
+// Parses the header and tags of a file. The program section isn't uncompressed
+// here: the returned file only points to it.
+Result<GSFFile> parse(std::span<const u8> data, const GsfAllocators &allocators)
+{
+    trace::Timed timed{GSF_TRACE_PARSE};
+    if (data.size() < HEADER_SIZE || data.size() > MAX_FILE_SIZE)
+        return tl::unexpected(make_err(GSF_INVALID_FILE_SIZE));
+    auto header = parse_header(data);
+    if (!header)
+        return tl::unexpected(header.error());
+    if (header->tags_offset() > data.size())
         return tl::unexpected(make_err(GSF_INVALID_SECTION_LENGTH));
-    // auto reserved = readb(reserved_length);
-    readb(reserved_length);
-    auto rom = program_length > 0 ? uncompress_rom(readb(program_length), crc, allocators) : Rom{allocators};
-    if (!rom)
-        return tl::unexpected(rom.error());
-    auto tags = cursor < data.size() - 5 && std::memcmp(readb(5).data(), "[TAG]", 5) == 0
-              ? readb(std::min<size_t>(data.size() - cursor, 50000u))
-              : std::span<u8>{};
     return GSFFile {
-        // .reserved = reserved,
-        std::move(rom.value()),
-        parse_tags(std::string_view((char *) tags.data(), tags.size()), allocators),
+        data.subspan(header->tags_offset() - header->program_length, header->program_length),
+        header->crc,
+        Rom{allocators},
+        parse_tags_section(data.subspan(header->tags_offset()), allocators),
     };
 }
 
-std::optional<String> find_lib(std::span<GSFFile> files, int n)
+std::optional<String> find_lib(std::span<const GSFFile *> files, int n)
 {
     auto key = String("_lib") + string::from_number<String>(n);
-    for (auto &f : files)
-        if (auto p = f.tags.find(key); p != f.tags.end())
+    for (auto *f : files) {
+        if (!f)
+            continue;
+        if (auto p = f->tags.find(key); p != f->tags.end())
             return p->second;
+    }
     return std::nullopt;
 }
 
-Result<GSFFile> load_file(fs::path filepath, const GsfReader &reader, const GsfAllocators &allocators)
+
+
+/* library cache */
+
+// Libraries are usually shared by every file of an album, so parsed ones are
+// kept around, shared between all emulators. Files read through the default
+// reader are looked up by path and modification time, so that they aren't
+// even read again; files from other readers must be read first, but are then
+// looked up by their CRC, skipping the check and uncompression.
+struct LibKey {
+    std::string path;
+    const void *reader;
+    void *userdata;
+    long long mtime;
+    std::size_t size;
+    u32 crc;
+
+    bool operator==(const LibKey &) const = default;
+};
+
+class LibCache {
+    struct Entry {
+        LibKey key;
+        std::shared_ptr<const GSFFile> file;
+    };
+
+    std::mutex mutex;
+    std::list<Entry> entries; // most recently used first
+    std::size_t bytes = 0;
+    std::size_t max_bytes = 64 * 1024 * 1024;
+
+    static std::size_t size_of(const GSFFile &f) { return f.rom.bytes().size(); }
+
+    void evict()
+    {
+        while (bytes > max_bytes && !entries.empty()) {
+            bytes -= size_of(*entries.back().file);
+            entries.pop_back();
+        }
+    }
+
+public:
+    std::shared_ptr<const GSFFile> find(const LibKey &key)
+    {
+        std::lock_guard lock{mutex};
+        auto it = std::find_if(entries.begin(), entries.end(), [&](const auto &e) { return e.key == key; });
+        if (it == entries.end())
+            return nullptr;
+        entries.splice(entries.begin(), entries, it);
+        return it->file;
+    }
+
+    // Returns the library now cached under `key`: another thread may have
+    // loaded the same one meanwhile, in which case that one is kept.
+    std::shared_ptr<const GSFFile> insert(LibKey key, std::shared_ptr<const GSFFile> file)
+    {
+        std::lock_guard lock{mutex};
+        auto it = std::find_if(entries.begin(), entries.end(), [&](const auto &e) { return e.key == key; });
+        if (it != entries.end()) {
+            entries.splice(entries.begin(), entries, it);
+            return it->file;
+        }
+        if (size_of(*file) > max_bytes)
+            return file;
+        bytes += size_of(*file);
+        entries.push_front(Entry { std::move(key), file });
+        evict();
+        return file;
+    }
+
+    bool enabled()
+    {
+        std::lock_guard lock{mutex};
+        return max_bytes > 0;
+    }
+
+    void set_max_bytes(std::size_t size)
+    {
+        std::lock_guard lock{mutex};
+        max_bytes = size;
+        evict();
+    }
+
+    void clear()
+    {
+        std::lock_guard lock{mutex};
+        entries.clear();
+        bytes = 0;
+    }
+} lib_cache;
+
+// Cached libraries outlive the allocators used to load them, so they always
+// use the default ones.
+const GsfAllocators cache_allocators = { detail::malloc, detail::free, nullptr };
+
+RomCache rom_cache;
+
+// Looks up the rom of a program in the disk cache, after checking its CRC,
+// so that a corrupted file fails to load just as it would without the cache.
+std::shared_ptr<const SharedRom> find_cached_rom(const GSFFile &file, ProgramHeader &header)
 {
-    constexpr int MAX_LIBS = 11;
-    auto parsebuf = [&](ManagedBuffer<u8, Deleter> buf) { return parse(buf.to_span(), allocators); };
-    auto files = Vector<GSFFile>(MAX_LIBS, GSFFile{allocators}, GsfAllocator<GSFFile>(allocators));
-    if (auto r = read_file(filepath, reader, allocators)
-                .and_then(parsebuf)
-                .map([&] (GSFFile &&f) { files[0] = std::move(f); }); !r)
-        return tl::unexpected(r.error());
-    if (auto tag = files[0].tags.find("_lib"); tag != files[0].tags.end()) {
-        if (auto r = read_file(filepath.parent_path() / tag->second, reader, allocators)
-                    .and_then(parsebuf)
-                    .map([&] (GSFFile &&f) {
-                        files[1] = std::move(f);
-                        files[1].impose(files[0]);
-                        std::swap(files[1].rom.data, files[0].rom.data);
-                    }); !r)
-            return tl::unexpected(r.error());
-        for (auto i = 2; i < MAX_LIBS; i++) {
-            if (auto libname = find_lib(std::span{files.begin(), files.begin() + i}, i); libname) {
-                if (auto r = read_file(filepath.parent_path() / libname.value(), reader, allocators)
-                            .and_then(parsebuf)
-                            .map([&] (GSFFile &&f) {
-                                files[i] = std::move(f);
-                                files[0].impose(files[i]);
-                            }); !r)
-                    return tl::unexpected(r.error());
+    if (!rom_cache.enabled())
+        return nullptr;
+    trace::Timed timed{GSF_TRACE_READ};
+    if (crc32(crc32(0l, nullptr, 0), file.program.data(), file.program.size()) != file.crc)
+        return nullptr;
+    return rom_cache.find(file.crc, file.program.size(), header);
+}
+
+// A library in a chain. Cached libraries are already uncompressed; other ones
+// still point to the data in `buf`.
+struct Lib {
+    std::shared_ptr<const GSFFile> file;
+    std::optional<ManagedBuffer<u8, Deleter>> buf;
+};
+
+// Makes a library out of its data. Libraries are cached under `key` if the
+// cache is enabled, and their roms are taken from (or put in) the disk cache
+// if that is; otherwise they keep pointing to `buf`.
+Result<Lib> make_lib(ManagedBuffer<u8, Deleter> &&buf, LibKey &&key, const GsfAllocators &allocators)
+{
+    if (!lib_cache.enabled() && !rom_cache.enabled()) {
+        return parse(buf.to_span(), allocators).map([&] (GSFFile &&f) {
+            return Lib { std::make_shared<const GSFFile>(std::move(f)), std::move(buf) };
+        });
+    }
+    auto file = parse(buf.to_span(), lib_cache.enabled() ? cache_allocators : allocators);
+    if (!file)
+        return tl::unexpected(file.error());
+    if (!file->program.empty()) {
+        auto header = ProgramHeader{};
+        if (auto cached = find_cached_rom(file.value(), header); cached)
+            file->rom.shared = std::move(cached);
+        else {
+            auto h = uncompress_program(file->program, file->crc, file->rom.data, false);
+            if (!h)
+                return tl::unexpected(h.error());
+            header = h.value();
+            file->rom.data.shrink_to_fit();
+            // share the library's rom with every emulator that plays it
+            auto shared = rom_cache.store(file->crc, file->program.size(), header, file->rom.data.bytes());
+            if (!shared)
+                shared = SharedRom::create(file->rom.data.bytes());
+            if (shared) {
+                file->rom.shared = std::move(shared);
+                file->rom.data = RomImage(cache_allocators);
             }
         }
+        file->rom.entry_point = header.entry_point;
+        file->rom.offset      = header.offset;
+        file->program = {};
+    }
+    auto ptr = std::make_shared<const GSFFile>(std::move(file.value()));
+    if (lib_cache.enabled())
+        ptr = lib_cache.insert(std::move(key), std::move(ptr));
+    return Lib { ptr, std::nullopt };
+}
+
+// Keys libraries not read from the filesystem on their size and header CRC,
+// which means their data must be read before looking them up.
+std::optional<Lib> find_lib_by_crc(LibKey &key, const ManagedBuffer<u8, Deleter> &buf)
+{
+    key.size = buf.size;
+    key.crc  = buf.size >= 16 ? read4(&buf.ptr[12]) : 0;
+    if (auto f = lib_cache.find(key); f)
+        return Lib { f, std::nullopt };
+    return std::nullopt;
+}
+
+Result<Lib> load_lib(const fs::path &filepath, const GsfReader &reader, const GsfAllocators &allocators)
+{
+    auto key = LibKey { filepath.string(), (const void *) reader.read, reader.userdata, 0, 0, 0 };
+    if (lib_cache.enabled() && reads_filesystem(reader)) {
+        std::error_code ec;
+        auto path = fs::canonical(filepath, ec);
+        auto mtime = ec ? fs::file_time_type{} : fs::last_write_time(path, ec);
+        auto size = ec ? 0 : fs::file_size(path, ec);
+        if (!ec) {
+            key = LibKey { path.string(), nullptr, nullptr, mtime.time_since_epoch().count(), size, 0 };
+            if (auto f = lib_cache.find(key); f)
+                return Lib { f, std::nullopt };
+        }
+    }
+    auto buf = read_file(filepath, reader, allocators);
+    if (!buf)
+        return tl::unexpected(buf.error());
+    if (lib_cache.enabled() && key.reader != nullptr)
+        if (auto lib = find_lib_by_crc(key, buf.value()); lib)
+            return std::move(lib.value());
+    return make_lib(std::move(buf.value()), std::move(key), allocators);
+}
+
+ManagedBuffer<u8, Deleter> from_memory(const GsfBuffer &buffer, const GsfAllocators &allocators)
+{
+    auto deleter = Deleter {
+        .fn = buffer.free, .userdata = buffer.userdata, .allocators = allocators, .size = buffer.size
+    };
+    return ManagedBuffer {
+        .ptr = std::unique_ptr<u8[], Deleter>{buffer.data, deleter},
+        .size = std::size_t(std::max(buffer.size, 0l)),
+    };
+}
+
+Result<Lib> load_memory_lib(const String &name, const GsfLibResolver *resolver, const GsfAllocators &allocators)
+{
+    if (!resolver)
+        return tl::unexpected(GsfError { .code = static_cast<int>(std::errc::no_such_file_or_directory), .from = 0 });
+    auto buffer = GsfBuffer { nullptr, 0, nullptr, nullptr };
+    if (auto err = resolver->resolve(name.c_str(), &buffer, resolver->userdata); err.code != 0)
+        return tl::unexpected(err);
+    auto buf = from_memory(buffer, allocators);
+    auto key = LibKey { std::string(name), (const void *) resolver->resolve, resolver->userdata, 0, 0, 0 };
+    if (lib_cache.enabled())
+        if (auto lib = find_lib_by_crc(key, buf); lib)
+            return std::move(lib.value());
+    return make_lib(std::move(buf), std::move(key), allocators);
+}
+
+// Reads only the header and the tags of a file, using two range reads. The
+// second read starts one byte early, so that a file truncated in the middle of
+// its program section is still caught.
+Result<GSFFile> read_tags(fs::path filepath, const GsfRangeReader &reader, const GsfAllocators &allocators)
+{
+    // files past MAX_FILE_SIZE are refused, as when loading them whole: a
+    // single byte past it says so without reading the rest
+    auto past_limit = read_file_range(filepath, MAX_FILE_SIZE, 1, reader, allocators);
+    if (!past_limit)
+        return tl::unexpected(past_limit.error());
+    if (past_limit->size != 0)
+        return tl::unexpected(make_err(GSF_INVALID_FILE_SIZE));
+    auto head = read_file_range(filepath, 0, HEADER_SIZE, reader, allocators);
+    if (!head)
+        return tl::unexpected(head.error());
+    auto header = parse_header(head->to_span());
+    if (!header)
+        return tl::unexpected(header.error());
+    if (header->tags_offset() > MAX_FILE_SIZE)
+        return tl::unexpected(make_err(GSF_INVALID_SECTION_LENGTH));
+    auto tail_size = std::min(MAX_TAGS_SIZE, MAX_FILE_SIZE - header->tags_offset()) + 1;
+    auto tail = read_file_range(filepath, header->tags_offset() - 1, tail_size, reader, allocators);
+    if (!tail)
+        return tl::unexpected(tail.error());
+    if (tail->size == 0)
+        return tl::unexpected(make_err(GSF_INVALID_SECTION_LENGTH));
+    trace::Timed timed{GSF_TRACE_PARSE};
+    return GSFFile {
+        std::span<const u8>{},
+        header->crc,
+        Rom{allocators},
+        parse_tags_section(tail->to_span().subspan(1), allocators),
+    };
+}
+
+// Loads a file and its libraries. All of them are first parsed, then their
+// roms are superimposed, in loading order, on a single rom image, which ends
+// up inside the returned file. Libraries are loaded by calling `read_lib` with
+// their name.
+// With `tags_only` set, only the tags of the file itself are read: tags aren't
+// inherited from libraries, so there's no need to look at them.
+template <typename F>
+Result<GSFFile> load_chain(std::span<const u8> data, const GsfAllocators &allocators, bool tags_only,
+    F &&read_lib)
+{
+    constexpr int MAX_LIBS = 11;
+    auto file = parse(data, allocators);
+    if (!file)
+        return tl::unexpected(file.error());
+    if (tags_only) {
+        file->program = {};
+        return file;
+    }
+    auto libs = std::array<Lib, MAX_LIBS>{};
+    auto files = std::array<const GSFFile *, MAX_LIBS>{};
+    files[0] = &file.value();
+    if (auto tag = file->tags.find("_lib"); tag != file->tags.end()) {
+        for (auto i = 1; i < MAX_LIBS; i++) {
+            auto libname = i == 1 ? std::optional<String>(tag->second)
+                                  : find_lib(std::span{files.begin(), files.begin() + i}, i);
+            if (!libname)
+                continue;
+            Result<Lib> lib = read_lib(libname.value());
+            if (!lib)
+                return tl::unexpected(lib.error());
+            libs[i] = std::move(lib.value());
+            files[i] = libs[i].file.get();
+        }
     }
-    return files[0];
+    // the _lib goes first, then the file itself, then every other library.
+    // A shared _lib is mapped instead of copied
+    auto &image = file->rom.data;
+    auto mapped = false;
+    if (files[1] && files[1]->rom.shared) {
+        trace::Timed timed{GSF_TRACE_IMPOSE};
+        mapped = image.map(*files[1]->rom.shared, files[1]->rom.offset & ROM_MASK);
+    }
+    if (files[1] && !mapped)
+        if (auto r = impose(image, *files[1]); !r)
+            return tl::unexpected(r.error());
+    if (auto r = impose(image, *files[0]); !r)
+        return tl::unexpected(r.error());
+    for (auto i = 2; i < MAX_LIBS; i++)
+        if (files[i])
+            if (auto r = impose(image, *files[i]); !r)
+                return tl::unexpected(r.error());
+    file->program = {};
+    return file;
+}
+
+Result<GSFFile> load_file(fs::path filepath, const GsfRangeReader &reader, const GsfAllocators &allocators,
+    bool tags_only = false)
+{
+    if (tags_only && reader.read_range)
+        return read_tags(filepath, reader, allocators);
+    auto buf = read_file(filepath, reader.reader, allocators);
+    if (!buf)
+        return tl::unexpected(buf.error());
+    return load_chain(buf->to_span(), allocators, tags_only, [&] (const String &libname) {
+        return load_lib(filepath.parent_path() / libname, reader.reader, allocators);
+    });
+}
+
+// Like load_file, but the file and its libraries are already in memory, so
+// they're parsed in place.
+Result<GSFFile> load_memory(const GsfBuffer &buffer, const GsfLibResolver *resolver,
+    const GsfAllocators &allocators, bool tags_only = false)
+{
+    auto buf = from_memory(buffer, allocators);
+    return load_chain(buf.to_span(), allocators, tags_only, [&] (const String &libname) {
+        return load_memory_lib(libname, resolver, allocators);
+    });
 }
 
 
@@ -324,56 +841,742 @@ Result<GSFFile> load_file(fs::path filepath, const GsfReader &reader, const GsfA
 constexpr auto NUM_SAMPLES = 2048;
 constexpr auto NUM_CHANNELS = 2;
 constexpr auto BUF_SIZE = NUM_CHANNELS * NUM_SAMPLES;
+constexpr auto NUM_VOICES = 6;
+constexpr auto NUM_MULTI_CHANNELS = NUM_VOICES * 2;
+
+// mGBA ends a blip_buf frame every this many cycles (see audio.c).
+constexpr int CLOCKS_PER_FRAME = 0x800;
+
+constexpr int channels_for(int flags) { return flags & GSF_MULTI ? NUM_MULTI_CHANNELS : NUM_CHANNELS; }
+
+// The rate at which mGBA samples audio: the GBA's clock (2^24 Hz) over the
+// default sample interval (0x200 cycles).
+constexpr int NATIVE_SAMPLE_RATE = 32768;
+
+// The rate of the samples we output...
+constexpr int output_rate(int sample_rate, int flags)
+{
+    return flags & GSF_RESAMPLER_NATIVE ? NATIVE_SAMPLE_RATE : sample_rate;
+}
+
+// ...and the rate blip_buf converts to, which is the same unless another
+// resampler comes after it.
+constexpr int blip_rate(int sample_rate, int flags)
+{
+    return flags & (GSF_RESAMPLER_NATIVE | GSF_RESAMPLER_SINC) ? NATIVE_SAMPLE_RATE : sample_rate;
+}
+
+constexpr long DEFAULT_SNAPSHOT_INTERVAL = 10000;
+constexpr std::size_t DEFAULT_SNAPSHOT_MAX_BYTES = 16 * 1024 * 1024;
 
 void post_audio_buffer(mAVStream *stream, blip_t *left, blip_t *right);
 
-struct AVStream : public mAVStream {
-    short samples[BUF_SIZE] = {};
-    long read = 0;
+// Samples each voice of the GBA mixer (the 4 PSG channels and the 2 FIFOs)
+// separately, for GSF_MULTI. mGBA only gives us its final mix, so we sample
+// the voices ourselves with a timing event that runs right before mGBA's own
+// sample event, on the same cycles, and feed them to our own blip_bufs. These
+// are kept in lockstep with mGBA's, so that they always have as many samples.
+struct Stems {
+    GBA *gba = nullptr;
+    std::array<blip_t *, NUM_MULTI_CHANNELS> blips = {};
+    std::array<int16_t, NUM_MULTI_CHANNELS> last = {};
+    mTimingEvent event = {};
+
+    Stems() = default;
+    Stems(const Stems &) = delete;
+    Stems & operator=(const Stems &) = delete;
+
+    ~Stems()
+    {
+        for (auto *b : blips)
+            if (b)
+                blip_delete(b);
+    }
+
+    bool init(mCore *core, int sample_rate)
+    {
+        gba = static_cast<GBA *>(core->board);
+        for (auto &b : blips) {
+            // same size as mGBA's
+            if (b = blip_new(0x4000); !b)
+                return false;
+            blip_set_rates(b, core->frequency(core), sample_rate);
+        }
+        event.context  = this;
+        event.name     = "libgsf stems";
+        event.callback = [](mTiming *timing, void *context, uint32_t cycles_late) {
+            static_cast<Stems *>(context)->sample(timing, cycles_late);
+        };
+        return true;
+    }
+
+    // Must be called whenever mGBA's sample event may have been rescheduled,
+    // i.e. after resets and after loading a savestate.
+    void schedule(mTiming *timing)
+    {
+        mTimingDeschedule(timing, &event);
+        auto *sample_event = &gba->audio.sampleEvent;
+        if (!mTimingIsScheduled(timing, sample_event))
+            return;
+        event.priority = std::max(sample_event->priority, 1u) - 1;
+        mTimingSchedule(timing, &event, sample_event->when - mTimingCurrentTime(timing));
+    }
+
+    void clear()
+    {
+        for (auto *b : blips)
+            blip_clear(b);
+        last = {};
+    }
+
+    // Same as mGBA's _applyBias, which it applies to the final mix instead.
+    static int apply_bias(const GBAAudio *audio, int sample)
+    {
+        auto bias = int(GBARegisterSOUNDBIASGetBias(audio->soundbias));
+        sample = std::clamp(sample + bias, 0, 0x3FF) - bias;
+        return (sample * audio->masterVolume * 3) >> 4;
+    }
+
+    std::array<int16_t, NUM_MULTI_CHANNELS> voices()
+    {
+        auto *audio = &gba->audio;
+        auto out = std::array<int16_t, NUM_MULTI_CHANNELS>{};
+        // isolate each PSG channel by disabling all the others, keeping
+        // those disabled by the user silent
+        bool disabled[4];
+        std::copy_n(audio->psg.forceDisableCh, 4, disabled);
+        auto psg_shift = 4 - audio->volume;
+        for (auto i = 0; i < 4; i++) {
+            if (disabled[i])
+                continue;
+            for (auto j = 0; j < 4; j++)
+                audio->psg.forceDisableCh[j] = j != i;
+            int16_t left, right;
+            GBAudioSamplePSG(&audio->psg, &left, &right);
+            out[i*2  ] = apply_bias(audio, left  >> psg_shift);
+            out[i*2+1] = apply_bias(audio, right >> psg_shift);
+        }
+        std::copy_n(disabled, 4, audio->psg.forceDisableCh);
+        auto fifo = [&](int voice, const GBAAudioFIFO &ch, bool disabled, bool volume, bool left, bool right) {
+            if (disabled)
+                return;
+            auto sample = (ch.sample << 2) >> !volume;
+            out[voice*2  ] = apply_bias(audio, left  ? sample : 0);
+            out[voice*2+1] = apply_bias(audio, right ? sample : 0);
+        };
+        fifo(4, audio->chA, audio->forceDisableChA, audio->volumeChA, audio->chALeft, audio->chARight);
+        fifo(5, audio->chB, audio->forceDisableChB, audio->volumeChB, audio->chBLeft, audio->chBRight);
+        return out;
+    }
+
+    // Mirrors what mGBA's sample event does with its own blip_bufs.
+    void sample(mTiming *timing, uint32_t cycles_late)
+    {
+        auto *audio = &gba->audio;
+        if (std::size_t(blip_samples_avail(audio->psg.left)) < audio->samples) {
+            auto values = voices();
+            for (auto i = 0; i < NUM_MULTI_CHANNELS; i++) {
+                blip_add_delta(blips[i], audio->clock, values[i] - last[i]);
+                last[i] = values[i];
+            }
+            if (audio->clock + audio->sampleInterval >= CLOCKS_PER_FRAME)
+                for (auto *b : blips)
+                    blip_end_frame(b, CLOCKS_PER_FRAME);
+        }
+        mTimingSchedule(timing, &event, audio->sampleInterval - cycles_late);
+    }
+
+    // Reads `count` frames of interleaved samples into `out`.
+    void read(short *out, long count, short *scratch)
+    {
+        for (auto i = 0; i < NUM_MULTI_CHANNELS; i++) {
+            blip_read_samples(blips[i], scratch, count, false);
+            for (auto j = 0; j < count; j++)
+                out[j * NUM_MULTI_CHANNELS + i] = scratch[j];
+        }
+    }
+};
+
+// Windowed-sinc polyphase resampler, for GSF_RESAMPLER_SINC. blip_buf then
+// outputs at the native rate, and this converts to the requested one. Each
+// output sample interpolates between the results of the two nearest of
+// PHASES precomputed filters.
+struct SincResampler {
+    static constexpr int TAPS       = 64;
+    static constexpr int HALF       = TAPS / 2;
+    static constexpr int PHASE_BITS = 8;
+    static constexpr int PHASES     = 1 << PHASE_BITS;
+    // Kaiser window for around 80 dB of stopband attenuation
+    static constexpr double ATTENUATION = 80.0;
+    static constexpr double BETA        = 0.1102 * (ATTENUATION - 8.7);
+
+    Vector<float> coeffs;   // PHASES + 1 filters of TAPS coefficients each
+    Vector<float> history;  // one plane of `capacity` samples per channel
+    int channels  = 0;
+    long capacity = 0;
+    long avail    = 0;      // samples in each plane
+    u64 pos  = 0;           // of the next output in history, 32.32 fixed point
+    u64 step = 0;
+
+    explicit SincResampler(const GsfAllocators &allocators)
+        : coeffs(GsfAllocator<float>(allocators)), history(GsfAllocator<float>(allocators))
+    { }
+
+    static double bessel_i0(double x)
+    {
+        double sum = 1.0, term = 1.0;
+        for (auto k = 1; term > sum * 1e-12; k++) {
+            term *= (x / (2 * k)) * (x / (2 * k));
+            sum += term;
+        }
+        return sum;
+    }
+
+    void init(int in_rate, int out_rate, int num_channels, long max_frames)
+    {
+        channels = num_channels;
+        step     = (u64(in_rate) << 32) / out_rate;
+        capacity = max_frames + TAPS;
+        history.resize(capacity * channels);
+        // place the transition band right below the lower of the two
+        // Nyquist frequencies (in cycles per input sample)
+        auto transition = (ATTENUATION - 8.0) / (2.285 * 2.0 * std::numbers::pi * TAPS);
+        auto cutoff = 0.5 * std::min(1.0, double(out_rate) / in_rate) - transition / 2.0;
+        coeffs.resize((PHASES + 1) * TAPS);
+        for (auto p = 0; p <= PHASES; p++) {
+            auto *c = coeffs.data() + p * TAPS;
+            double sum = 0.0;
+            for (auto k = 0; k < TAPS; k++) {
+                // distance between the output and the input sample this tap
+                // is applied to
+                auto t = double(p) / PHASES + HALF - 1 - k;
+                auto x = 2.0 * cutoff * t;
+                auto sinc = x == 0.0 ? 1.0 : std::sin(std::numbers::pi * x) / (std::numbers::pi * x);
+                auto w = t / HALF;
+                auto window = std::abs(w) >= 1.0 ? 0.0 : bessel_i0(BETA * std::sqrt(1.0 - w * w)) / bessel_i0(BETA);
+                c[k] = float(sinc * window);
+                sum += c[k];
+            }
+            for (auto k = 0; k < TAPS; k++)
+                c[k] = float(c[k] / sum);
+        }
+        clear();
+    }
+
+    void clear()
+    {
+        // start with silence before the first sample, so that the first
+        // output lines up with it
+        std::fill(history.begin(), history.end(), 0.0f);
+        avail = HALF - 1;
+        pos   = u64(HALF - 1) << 32;
+    }
+
+    long max_output(long frames) const { return long((u64(frames) << 32) / step) + 2; }
+
+    // Resamples `frames` frames of interleaved samples from `in` into `out`,
+    // returning how many frames it wrote. Outputs that need samples past the
+    // end of `in` are left for the next call. With no `out`, nothing gets
+    // filtered, but the state moves on exactly as if it had been.
+    long process(const short *in, long frames, short *out)
+    {
+        for (auto c = 0; c < channels; c++) {
+            auto *plane = history.data() + c * capacity + avail;
+            for (auto i = 0; i < frames; i++)
+                plane[i] = in[i * channels + c];
+        }
+        avail += frames;
+        const auto &kernels = convert::kernels();
+        long n = 0;
+        for (; !out && long(pos >> 32) + HALF < avail; n++)
+            pos += step;
+        for (; long(pos >> 32) + HALF < avail; n++, pos += step) {
+            auto first = long(pos >> 32) - (HALF - 1);
+            auto frac  = u32(pos);
+            auto t     = float(frac & ((1u << (32 - PHASE_BITS)) - 1)) / float(1u << (32 - PHASE_BITS));
+            const auto *a = coeffs.data() + (frac >> (32 - PHASE_BITS)) * TAPS;
+            const auto *b = a + TAPS;
+            for (auto c = 0; c < channels; c++) {
+                float ra, rb;
+                kernels.dot2(history.data() + c * capacity + first, a, b, TAPS, ra, rb);
+                out[n * channels + c] = short(std::clamp(std::lrint(ra + (rb - ra) * t), -32768L, 32767L));
+            }
+        }
+        // keep only what the next outputs need
+        if (auto drop = long(pos >> 32) - (HALF - 1); drop > 0) {
+            for (auto c = 0; c < channels; c++) {
+                auto *plane = history.data() + c * capacity;
+                std::copy(plane + drop, plane + avail, plane);
+            }
+            avail -= drop;
+            pos -= u64(drop) << 32;
+        }
+        return n;
+    }
+
+    std::size_t state_size() const { return sizeof(pos) + sizeof(avail) + channels * avail * sizeof(float); }
+
+    void save(u8 *out) const
+    {
+        std::memcpy(out, &pos, sizeof(pos));
+        std::memcpy(out + sizeof(pos), &avail, sizeof(avail));
+        out += sizeof(pos) + sizeof(avail);
+        for (auto c = 0; c < channels; c++, out += avail * sizeof(float))
+            std::memcpy(out, history.data() + c * capacity, avail * sizeof(float));
+    }
+
+    void load(const u8 *in)
+    {
+        std::memcpy(&pos, in, sizeof(pos));
+        std::memcpy(&avail, in + sizeof(pos), sizeof(avail));
+        in += sizeof(pos) + sizeof(avail);
+        for (auto c = 0; c < channels; c++, in += avail * sizeof(float))
+            std::memcpy(history.data() + c * capacity, in, avail * sizeof(float));
+    }
+};
+
+// Tag volume and fade out, applied to samples on their way out. Gains are
+// computed a block of frames at a time, so that applying them is a plain
+// multiplication loop the compiler can vectorize.
+struct Envelope {
+    static constexpr long BLOCK = 256;
+    // a log fade goes linearly down to -60 dB, then gets stretched so that
+    // it ends on silence
+    static constexpr float LOG_FADE_RANGE = 1000.0f;
+
+    float volume = 1.0f;
+    GsfFade fade = GSF_FADE_NONE;
+    long fade_start = 0;    // in frames
+    long fade_frames = 0;
+
+    bool active(long frame, long n) const
+    {
+        return volume != 1.0f || (fade != GSF_FADE_NONE && frame + n > fade_start);
+    }
+
+    float fade_gain(long frame) const
+    {
+        if (fade == GSF_FADE_NONE || frame < fade_start)
+            return 1.0f;
+        if (frame >= fade_start + fade_frames)
+            return 0.0f;
+        auto x = float(frame - fade_start) / float(fade_frames);
+        return fade == GSF_FADE_LINEAR ? 1.0f - x
+             : (std::pow(LOG_FADE_RANGE, 1.0f - x) - 1.0f) / (LOG_FADE_RANGE - 1.0f);
+    }
+
+    void gains(float *out, long frame, long n) const
+    {
+        if (fade == GSF_FADE_NONE || frame + n <= fade_start) {
+            std::fill_n(out, n, volume);
+            return;
+        }
+        for (auto i = 0; i < n; i++)
+            out[i] = volume * fade_gain(frame + i);
+    }
+
+    // Applies gains to `frames` frames of `channels` interleaved samples,
+    // the first one being at `frame` in the track.
+    template <typename T>
+    void apply(T *samples, long frame, long frames, int channels) const
+    {
+        float g[BLOCK];
+        for (long done = 0; done < frames; done += BLOCK) {
+            auto n = std::min(BLOCK, frames - done);
+            gains(g, frame + done, n);
+            auto *p = samples + done * channels;
+            for (auto i = 0; i < n; i++) {
+                for (auto c = 0; c < channels; c++) {
+                    if constexpr (std::is_same_v<T, short>)
+                        p[i*channels + c] = std::clamp(int(p[i*channels + c] * g[i]), -32768, 32767);
+                    else
+                        p[i*channels + c] *= g[i];
+                }
+            }
+        }
+    }
+};
+
+// Where gsf_play and its variants write samples, and in which format. Like
+// everywhere else, positions and sizes count samples, not frames; planar and
+// mono outputs only ever get whole frames.
+struct Output {
+    enum class Format { S16, F32, F32_PLANAR, F32_MONO };
+
+    Format format = Format::S16;
+    void *data = nullptr;   // short *, float *, or float *const * when planar
+    int channels = NUM_CHANNELS;
+    long pos = 0;
+    const Envelope *envelope = nullptr;
+    long start = 0;         // position in the track of the first sample
+
+    bool is_s16() const { return format == Format::S16; }
+    bool whole_frames() const { return format == Format::F32_PLANAR || format == Format::F32_MONO; }
+    short *s16() const { return static_cast<short *>(data) + pos; }
+    float *f32() const { return static_cast<float *>(data) + pos; }
+    float *mono() const { return static_cast<float *>(data) + pos / channels; }
+    float *const *planes() const { return static_cast<float *const *>(data); }
+
+    void write(const short *in, long n)
+    {
+        switch (format) {
+        case Format::S16:        std::copy_n(in, n, s16()); break;
+        case Format::F32:        convert::to_f32(in, f32(), n); break;
+        case Format::F32_PLANAR: convert::to_planar_f32(in, planes(), pos / channels, channels, n / channels); break;
+        case Format::F32_MONO:   convert::to_mono_f32(in, mono(), channels, n / channels); break;
+        }
+        wrote(n);
+    }
+
+    // Called once `n` samples have been written at the current position.
+    void wrote(long n)
+    {
+        auto frame = (start + pos) / channels, frames = n / channels;
+        if (envelope && envelope->active(frame, frames)) {
+            switch (format) {
+            case Format::S16:        envelope->apply(s16(), frame, frames, channels); break;
+            case Format::F32:        envelope->apply(f32(), frame, frames, channels); break;
+            case Format::F32_PLANAR:
+                for (auto c = 0; c < channels; c++)
+                    envelope->apply(planes()[c] + pos / channels, frame, frames, 1);
+                break;
+            case Format::F32_MONO:   envelope->apply(mono(), frame, frames, 1); break;
+            }
+        }
+        pos += n;
+    }
+
+    void zero(long n)
+    {
+        switch (format) {
+        case Format::S16:        std::fill_n(s16(), n, 0); break;
+        case Format::F32:        std::fill_n(f32(), n, 0.0f); break;
+        case Format::F32_PLANAR:
+            for (auto c = 0; c < channels; c++)
+                std::fill_n(planes()[c] + pos / channels, n / channels, 0.0f);
+            break;
+        case Format::F32_MONO:   std::fill_n(mono(), n / channels, 0.0f); break;
+        }
+        pos += n;
+    }
+};
 
-    AVStream() : mAVStream()
+// Receives samples from mGBA. When there's a destination buffer, samples are
+// written straight into it, and only what doesn't fit is kept in `samples`.
+// With stems, samples come from them instead of mGBA's mix. Formats other
+// than 16-bit get converted here, one buffer's worth at a time, while the
+// samples are still in cache.
+struct AVStream : public mAVStream {
+    Vector<short> samples;
+    long read = 0;          // samples left to take, at the end of `samples`
+    Output *dest = nullptr;
+    long dest_size = 0;     // room left in dest
+    long written = 0;       // samples written to dest
+    Stems *stems = nullptr;
+    int channels = NUM_CHANNELS;
+    SincResampler *resampler = nullptr;
+    bool discard = false;   // samples are only counted, for a first pass
+    Vector<short> convert_buf;
+    Vector<short> resampled;
+    short scratch[NUM_SAMPLES];
+
+    explicit AVStream(const GsfAllocators &allocators)
+        : mAVStream(), samples(GsfAllocator<short>(allocators)),
+          convert_buf(GsfAllocator<short>(allocators)),
+          resampled(GsfAllocator<short>(allocators))
     {
         this->postAudioBuffer = post_audio_buffer;
+        samples.reserve(2 * BUF_SIZE);
     }
 
-    void take(std::span<short> out)
+    void set_stems(Stems *s)
     {
-        auto index = BUF_SIZE - read;
-        std::copy_n(std::begin(samples) + index, out.size(), out.begin());
-        read -= out.size();
+        stems = s;
+        channels = s ? NUM_MULTI_CHANNELS : NUM_CHANNELS;
+        samples.reserve(2 * NUM_SAMPLES * channels);
+    }
+
+    // Must come after set_stems, if there are stems.
+    void set_resampler(SincResampler *r)
+    {
+        resampler = r;
+        convert_buf.resize(NUM_SAMPLES * channels);
+        resampled.resize(r->max_output(NUM_SAMPLES) * channels);
+        samples.reserve(2 * resampled.size());
+    }
+
+    void take(Output &out, long n)
+    {
+        out.write(samples.data() + samples.size() - read, n);
+        read -= n;
     }
 
     void clear(long n) { read -= n; }
+
+    // Makes room for `n` more samples to take, returning where to put them.
+    short *append(long n)
+    {
+        if (read == 0)
+            samples.clear();
+        samples.resize(samples.size() + n);
+        read += n;
+        return samples.data() + samples.size() - n;
+    }
+
+    void set_dest(Output *out, long size)
+    {
+        dest = out;
+        dest_size = size;
+        written = 0;
+        if (!out->is_s16() && convert_buf.empty())
+            convert_buf.resize(NUM_SAMPLES * channels);
+    }
+
+    long unset_dest()
+    {
+        dest = nullptr;
+        dest_size = 0;
+        return std::exchange(written, 0);
+    }
+
+    void read_frames(blip_t *left, blip_t *right, short *out, long count)
+    {
+        if (stems) {
+            stems->read(out, count, scratch);
+            // mGBA's mix isn't used, but its blip_bufs must still be emptied
+            blip_read_samples(left,  scratch, count, false);
+            blip_read_samples(right, scratch, count, false);
+        } else {
+            blip_read_samples(left,  out,   count, true);
+            blip_read_samples(right, out+1, count, true);
+        }
+    }
+
+    // Writes as much of `frames` frames from `in` as fits into the
+    // destination, keeping the rest to take later.
+    void deliver(const short *in, long frames)
+    {
+        auto direct = std::min(frames, dest_size / channels);
+        if (direct > 0) {
+            dest->write(in, direct * channels);
+            dest_size -= direct * channels;
+            written   += direct * channels;
+        }
+        if (auto rest = frames - direct; rest > 0)
+            std::copy_n(in + direct * channels, rest * channels, append(rest * channels));
+    }
+
+    void write_frames(blip_t *left, blip_t *right, long count)
+    {
+        if (dest->is_s16()) {
+            read_frames(left, right, dest->s16(), count);
+            dest->wrote(count * channels);
+        } else {
+            read_frames(left, right, convert_buf.data(), count);
+            dest->write(convert_buf.data(), count * channels);
+        }
+    }
 };
 
 void post_audio_buffer(mAVStream *stream, blip_t *left, blip_t *right)
 {
+    trace::Scope scope{GSF_TRACE_MIX};
     auto *self = (AVStream *) stream;
-    /*auto samples_read1 =*/ blip_read_samples(left,  self->samples,   NUM_SAMPLES, true);
-    /*auto samples_read2 =*/ blip_read_samples(right, self->samples+1, NUM_SAMPLES, true);
-    self->read += BUF_SIZE;
+    // blip_buf must always be emptied, or mGBA stops feeding it
+    if (self->resampler) {
+        self->read_frames(left, right, self->convert_buf.data(), NUM_SAMPLES);
+        if (self->discard) {
+            self->append(self->resampler->process(self->convert_buf.data(), NUM_SAMPLES, nullptr)
+                         * self->channels);
+            return;
+        }
+        auto n = self->resampler->process(self->convert_buf.data(), NUM_SAMPLES, self->resampled.data());
+        self->deliver(self->resampled.data(), n);
+        return;
+    }
+    auto direct = std::min<long>(NUM_SAMPLES, self->dest_size / self->channels);
+    if (direct > 0) {
+        self->write_frames(left, right, direct);
+        self->dest_size -= direct * self->channels;
+        self->written   += direct * self->channels;
+    }
+    if (auto rest = NUM_SAMPLES - direct; rest > 0)
+        self->read_frames(left, right, self->append(rest * self->channels), rest);
 }
 
+// Audio state saved in a snapshot, besides the savestate itself. Stems are
+// only saved with GSF_MULTI, and the resampler only with GSF_RESAMPLER_SINC.
+struct AudioState {
+    int16_t last_left;
+    int16_t last_right;
+    int clock;
+    u32 left_size;
+    u32 right_size;
+    std::array<int16_t, NUM_MULTI_CHANNELS> stems_last;
+    std::array<u32, NUM_MULTI_CHANNELS> stems_size;
+    u32 resampler_size;
+};
+
+struct Snapshot {
+    long position;
+    std::size_t size;
+    Vector<u8> data;
+    bool exact; // false if taken while fast seeking
+};
+
+// Sample interval used while fast seeking. mGBA ends a blip_buf frame at most
+// once per sample, so we can't go any higher than that.
+constexpr int32_t FAST_SEEK_SAMPLE_INTERVAL = CLOCKS_PER_FRAME;
+
+// How many frames before the seek target to go back to the normal sample
+// interval: enough to flush both our buffer and blip_buf's, and to let
+// blip_buf's integrator settle.
+constexpr long FAST_SEEK_MARGIN = 4 * NUM_SAMPLES;
+
+// Idle loop overrides, by game code. An address of IDLE_LOOP_NONE means the
+// idle loop optimization is turned off for that game.
+class IdleLoopOverrides {
+    struct Entry {
+        std::array<char, 4> code;
+        u32 address;
+    };
+
+    std::mutex mutex;
+    std::vector<Entry> entries;
+
+public:
+    void set(std::array<char, 4> code, u32 address)
+    {
+        std::lock_guard lock{mutex};
+        auto it = std::find_if(entries.begin(), entries.end(), [&](const auto &e) { return e.code == code; });
+        if (it != entries.end())
+            it->address = address;
+        else
+            entries.push_back(Entry { code, address });
+    }
+
+    std::optional<u32> find(std::array<char, 4> code)
+    {
+        std::lock_guard lock{mutex};
+        auto it = std::find_if(entries.begin(), entries.end(), [&](const auto &e) { return e.code == code; });
+        return it != entries.end() ? std::optional<u32>(it->address) : std::nullopt;
+    }
+
+    void clear()
+    {
+        std::lock_guard lock{mutex};
+        entries.clear();
+    }
+} idle_loop_overrides;
+
+constexpr std::size_t GAME_CODE_OFFSET = 0xAC;
+
+// A video renderer that draws nothing. GSF rips never show anything, so there's
+// no point in spending time on the PPU beyond what's needed for timing (which
+// mGBA does by itself through its scanline events, not through the renderer).
+// Registers are returned as written, since nothing reads them back for drawing.
+struct NullRenderer : public GBAVideoRenderer {
+    NullRenderer() : GBAVideoRenderer()
+    {
+        this->init               = [](GBAVideoRenderer *) { };
+        this->reset              = [](GBAVideoRenderer *) { };
+        this->deinit             = [](GBAVideoRenderer *) { };
+        this->writeVideoRegister = [](GBAVideoRenderer *, uint32_t, uint16_t value) { return value; };
+        this->writeVRAM          = [](GBAVideoRenderer *, uint32_t) { };
+        this->writePalette       = [](GBAVideoRenderer *, uint32_t, uint16_t) { };
+        this->writeOAM           = [](GBAVideoRenderer *, uint32_t) { };
+        this->drawScanline       = [](GBAVideoRenderer *, int) { };
+        this->finishFrame        = [](GBAVideoRenderer *) { };
+        this->getPixels          = [](GBAVideoRenderer *, size_t *stride, const void **pixels) {
+            *stride = 0;
+            *pixels = nullptr;
+        };
+        this->putPixels          = [](GBAVideoRenderer *, size_t, const void *) { };
+    }
+};
+
+// Catches an emulator being used from two threads at once, in debug builds.
+// Different emulators can always be used from different threads: they share
+// nothing but the library cache and the idle loop overrides, which have
+// their own locks, and mGBA's logger, which is set once and never changes.
+class UseCheck {
+#ifndef NDEBUG
+    std::atomic<bool> in_use = false;
+#endif
+
+public:
+    struct Scope {
+#ifndef NDEBUG
+        UseCheck *check;
+        ~Scope() { check->in_use.store(false, std::memory_order_release); }
+#endif
+    };
+
+    [[nodiscard]] Scope enter()
+    {
+#ifndef NDEBUG
+        [[maybe_unused]] bool was_in_use = in_use.exchange(true, std::memory_order_acquire);
+        assert(!was_in_use && "the same GsfEmu was used from two threads at once");
+        return Scope { this };
+#else
+        return Scope {};
+#endif
+    }
+};
+
 class GsfEmu {
     mCore *core;
     int samplerate;
     int flags;
+    GsfAllocators allocators;
+    RomImage rom;
     TagMap tags;
     AVStream av;
+    Stems stems;
+    SincResampler resampler;
+    NullRenderer renderer;
     long num_samples = 0;
     long max_samples = 0;
     int default_len  = 0;
     bool loaded      = false;
     bool infinite    = false;
+    long fade_samples = 0;
+    bool use_tag_volume = false;
+    float tag_volume = 1.0f;
+    GsfFade fade = GSF_FADE_NONE;
+    Vector<Snapshot> snapshots;
+    Vector<u8> state_buf;
+    long snapshot_interval = 0;
+    long snapshot_base_interval = 0;
+    std::size_t snapshot_max_bytes = DEFAULT_SNAPSHOT_MAX_BYTES;
+    std::size_t snapshot_bytes = 0;
+    bool fast_seek = false;
+    bool fast_forwarding = false;
+    unsigned muted = 0, soloed = 0;     // bit masks of GsfChannel values
+    trace::LoadStats load_stats;
+    struct Counters {
+        u64 cycles = 0, frames = 0, played = 0, skipped = 0;
+    } counters;
+    UseCheck use_check;
 
 public:
     explicit GsfEmu(mCore *core, int sample_rate, int flags, const GsfAllocators &allocators)
-        : core{core}, samplerate{sample_rate}, flags{flags},
-          tags(GsfAllocator<std::pair<const String, String>>(allocators))
+        : core{core}, samplerate{output_rate(sample_rate, flags)}, flags{flags}, allocators{allocators},
+          rom(allocators),
+          tags(GsfAllocator<std::pair<const String, String>>(allocators)),
+          av(allocators),
+          resampler(allocators),
+          snapshots(GsfAllocator<Snapshot>(allocators)),
+          state_buf(GsfAllocator<u8>(allocators)),
+          snapshot_interval{millis_to_samples(DEFAULT_SNAPSHOT_INTERVAL, samplerate, channels_for(flags))},
+          snapshot_base_interval{snapshot_interval}
     { }
 
     static Result<GsfEmu *> create(int sample_rate, int flags, const GsfAllocators &allocators)
     {
+        // there's nothing to resample at the native rate
+        if (flags & GSF_RESAMPLER_NATIVE)
+            flags &= ~GSF_RESAMPLER_SINC;
         if (flags & GSF_INFO_ONLY) {
             auto *emu = allocate<GsfEmu>(allocators, 1, nullptr, sample_rate, flags, allocators);
             if (!emu)
@@ -381,85 +1584,542 @@ public:
             return emu;
         }
 
-        auto core = GBACoreCreate();
-        if (!core->init(core))
-            return tl::unexpected(make_err(GSF_ALLOCATION_FAILED));
-        mCoreInitConfig(core, nullptr);
-        core->setAudioBufferSize(core, NUM_SAMPLES);
-        auto clock_rate = core->frequency(core);
-        for (auto i = 0; i < NUM_CHANNELS; i++)
-            blip_set_rates(core->getAudioChannel(core, i), clock_rate, sample_rate);
-        mCoreOptions opts = {};
-        opts.skipBios = true;
-        opts.useBios = false;
-        opts.sampleRate = static_cast<unsigned>(sample_rate);
-        mCoreConfigLoadDefaults(&core->config, &opts);
-        auto *emu = allocate<GsfEmu>(allocators, 1, core, sample_rate, flags, allocators);
-        if (!emu) {
-            core->deinit(core);
-            return tl::unexpected(make_err(GSF_ALLOCATION_FAILED));
+        auto core = GBACoreCreate();
+        if (!core->init(core))
+            return tl::unexpected(make_err(GSF_ALLOCATION_FAILED));
+        mCoreInitConfig(core, nullptr);
+        core->setAudioBufferSize(core, NUM_SAMPLES);
+        auto clock_rate = core->frequency(core);
+        auto rate = blip_rate(sample_rate, flags);
+        for (auto i = 0; i < NUM_CHANNELS; i++)
+            blip_set_rates(core->getAudioChannel(core, i), clock_rate, rate);
+        mCoreOptions opts = {};
+        opts.skipBios = true;
+        opts.useBios = false;
+        opts.sampleRate = static_cast<unsigned>(rate);
+        mCoreConfigLoadDefaults(&core->config, &opts);
+        auto *emu = allocate<GsfEmu>(allocators, 1, core, sample_rate, flags, allocators);
+        if (!emu) {
+            core->deinit(core);
+            return tl::unexpected(make_err(GSF_ALLOCATION_FAILED));
+        }
+        if (flags & GSF_MULTI) {
+            if (!emu->stems.init(core, rate)) {
+                emu->~GsfEmu();
+                allocators.free(emu, sizeof(GsfEmu), allocators.userdata);
+                return tl::unexpected(make_err(GSF_ALLOCATION_FAILED));
+            }
+            emu->av.set_stems(&emu->stems);
+        }
+        if (flags & GSF_RESAMPLER_SINC) {
+            emu->resampler.init(rate, sample_rate, emu->num_channels(), NUM_SAMPLES);
+            emu->av.set_resampler(&emu->resampler);
+        }
+        core->setAVStream(core, &emu->av);
+        // frames are never shown, so skip every one of them: this stops mGBA
+        // from even calling the renderer on each scanline
+        auto *gba = emu->board();
+        GBAVideoAssociateRenderer(&gba->video, &emu->renderer);
+        gba->video.frameskip = std::numeric_limits<int>::max();
+        return emu;
+    }
+
+    ~GsfEmu()
+    {
+        if (core)
+            core->deinit(core);
+        core = nullptr;
+    }
+
+    int load(RomImage &&data, TagMap &&tags)
+    {
+        auto scope = use_check.enter();
+        if (!(flags & GSF_INFO_ONLY)) {
+            trace::Timed timed{GSF_TRACE_SETUP};
+            // mGBA reads straight from our rom image, so the old one must
+            // be unloaded before we replace it
+            core->unloadROM(core);
+            rom = std::move(data);
+            auto *vmem = VFileFromConstMemory(rom.data(), rom.size());
+            core->loadROM(core, vmem);
+            // forget the last rom's idle loop; resetting may then find one in
+            // mGBA's own override table
+            board()->idleLoop = IDLE_LOOP_NONE;
+            reset();
+            setup_idle_loop();
+            // start the new file from the beginning, with nothing left over
+            // from the last one
+            num_samples = 0;
+            av.read = 0;
+        }
+        this->tags = std::move(tags);
+        auto length_tag = get_tag("length").value_or("");
+        auto length = length_tag == "" ? default_len : parse_duration(length_tag).value_or(-1);
+        max_samples = millis_to_samples(length, samplerate, num_channels());
+        fade_samples = millis_to_samples(parse_duration(get_tag("fade").value_or("")).value_or(0),
+                                         samplerate, num_channels());
+        auto volume = string::to_number<double>(get_tag("volume").value_or("")).value_or(0.0);
+        tag_volume = volume > 0.0 ? float(volume) : 1.0f;
+        snapshots.clear();
+        snapshot_bytes = 0;
+        snapshot_interval = snapshot_base_interval;
+        counters = {};
+        loaded = true;
+        return 0;
+    }
+
+    // Forgets the loaded file, keeping the core and all settings, so that
+    // loading the next file doesn't need a new core.
+    void unload()
+    {
+        auto scope = use_check.enter();
+        if (!(flags & GSF_INFO_ONLY) && loaded)
+            core->unloadROM(core);
+        rom = RomImage(allocators);
+        tags.clear();
+        snapshots.clear();
+        snapshot_bytes = 0;
+        snapshot_interval = snapshot_base_interval;
+        num_samples = 0;
+        max_samples = 0;
+        fade_samples = 0;
+        tag_volume = 1.0f;
+        av.read = 0;
+        load_stats = {};
+        counters = {};
+        loaded = false;
+    }
+
+    // Puts every setting back to what it is after creation.
+    void reset_settings()
+    {
+        default_len = 0;
+        infinite = false;
+        fade = GSF_FADE_NONE;
+        use_tag_volume = false;
+        fast_seek = false;
+        set_snapshots(DEFAULT_SNAPSHOT_INTERVAL, DEFAULT_SNAPSHOT_MAX_BYTES);
+        muted = soloed = 0;
+        apply_channel_mask();
+    }
+
+    GBA *board() const { return static_cast<GBA *>(core->board); }
+
+    bool multi() const { return flags & GSF_MULTI; }
+
+    void reset()
+    {
+        core->reset(core);
+        apply_channel_mask();
+        if (flags & GSF_RESAMPLER_SINC)
+            resampler.clear();
+        if (multi()) {
+            stems.clear();
+            stems.schedule(core->timing);
+        }
+    }
+
+    // Most sound drivers wait for VBlank in a loop, which mGBA can skip once
+    // it knows where it is. Overrides win over both mGBA's own table and
+    // detection.
+    void setup_idle_loop()
+    {
+        auto *gba = board();
+        gba->idleOptimization = IDLE_LOOP_DETECT;
+        if (rom.size() < GAME_CODE_OFFSET + 4)
+            return;
+        auto code = std::array<char, 4>{};
+        std::copy_n(&rom[GAME_CODE_OFFSET], 4, code.begin());
+        if (auto address = idle_loop_overrides.find(code); address) {
+            gba->idleLoop = address.value();
+            gba->idleOptimization = address.value() == IDLE_LOOP_NONE ? IDLE_LOOP_IGNORE : IDLE_LOOP_REMOVE;
+        }
+    }
+
+    std::optional<u32> idle_loop() const
+    {
+        if (!core || !loaded || board()->idleLoop == IDLE_LOOP_NONE
+         || board()->idleOptimization == IDLE_LOOP_IGNORE)
+            return std::nullopt;
+        return board()->idleLoop;
+    }
+
+    void play(Output out, long size)
+    {
+        auto scope = use_check.enter();
+        if (flags & GSF_INFO_ONLY)
+            return;
+        if (!loaded) {
+            out.channels = num_channels();
+            out.zero(size);
+            return;
+        }
+        out.zero(size - render(out, size, std::nullopt));
+    }
+
+    // Same as play, but stops emulating once `cycles` cycles have gone by,
+    // and returns how many samples it wrote instead of zeroing the rest.
+    long play_budgeted(Output out, long size, long cycles)
+    {
+        auto scope = use_check.enter();
+        if (flags & GSF_INFO_ONLY || !loaded)
+            return 0;
+        return render(out, size, mTimingGlobalTime(core->timing) + std::max(cycles, 0L));
+    }
+
+    // Estimates how many cycles it takes to emulate the next `size` samples.
+    // Samples already buffered, in `av` or in blip_buf, come for free, but
+    // mGBA only hands samples over once it has a whole buffer of them, so
+    // anything more costs whole buffers.
+    long play_cost(long size) const
+    {
+        if (flags & GSF_INFO_ONLY || !loaded)
+            return 0;
+        auto wanted = infinite ? size : std::clamp(end_samples() - num_samples, 0L, size);
+        auto frames = static_cast<long long>(std::max(wanted - av.read, 0L) / num_channels());
+        if (frames == 0)
+            return 0;
+        long long rate = flags & (GSF_RESAMPLER_NATIVE | GSF_RESAMPLER_SINC) ? NATIVE_SAMPLE_RATE : samplerate;
+        long long block   = board()->audio.samples;
+        long long pending = blip_samples_avail(core->getAudioChannel(core, 0));
+        auto needed = (frames * rate + samplerate - 1) / samplerate;
+        auto to_emulate = std::max((needed - pending + block - 1) / block * block, 0LL);
+        return static_cast<long>((to_emulate * core->frequency(core) + rate - 1) / rate);
+    }
+
+    long render(Output &out, long size, std::optional<u64> deadline)
+    {
+        out.channels = num_channels();
+        // outputs of whole frames can't start in the middle of one, which
+        // an earlier gsf_play or seek may have left us in: drop the rest of it
+        if (auto partial = num_samples % out.channels; out.whole_frames() && partial != 0) {
+            auto rest = std::min<long>(out.channels - partial, av.read);
+            av.clear(rest);
+            num_samples += rest;
+        }
+        auto envelope = output_envelope();
+        out.start    = num_samples;
+        out.envelope = envelope ? &*envelope : nullptr;
+        long took = 0;
+        while (took < size && !ended()) {
+            // never write past the end directly, so that what's after it
+            // stays buffered in case the length changes
+            auto room = infinite ? size - took : std::min(size - took, end_samples() - num_samples);
+            if (av.read > 0) {
+                auto to_take = std::min(room, av.read);
+                av.take(out, to_take);
+                took += to_take;
+                num_samples += to_take;
+                continue;
+            }
+            av.set_dest(&out, room);
+            fill(deadline);
+            auto written = av.unset_dest();
+            took += written;
+            num_samples += written;
+            if (written == 0 && av.read == 0)
+                break;
+        }
+        counters.played += took;
+        return took;
+    }
+
+    GsfError skip(long n)
+    {
+        auto scope = use_check.enter();
+        if (flags & GSF_INFO_ONLY || !loaded)
+            return { .code = 0, .from = 0 };
+        trace::Scope trace_scope{GSF_TRACE_SEEK};
+        auto target = num_samples + n;
+        if (target < 0 || (!infinite && target > end_samples()))
+            return make_err(GSF_SEEK_OUT_OF_BOUNDS);
+        // restart from the closest snapshot before the target, as long as
+        // it's closer than where we are now
+        auto *snapshot = find_snapshot(target);
+        auto restored = snapshot && (n < 0 || snapshot->position > num_samples)
+                     && load_snapshot(*snapshot);
+        if (!restored && n < 0) {
+            reset();
+            num_samples = 0;
+            av.read = 0;
+        }
+        n = target - num_samples;
+        if (fast_seek && n > 0)
+            set_fast_forward(true);
+        for (auto took = 0; took < n && !ended(); ) {
+            // go back to full quality a little before the target, so that
+            // the samples buffered when we get there are exact
+            if (n - took <= FAST_SEEK_MARGIN * num_channels())
+                set_fast_forward(false);
+            fill();
+            auto to_take = std::min(n - took, av.read);
+            av.clear(to_take);
+            took += to_take;
+            num_samples += to_take;
+            counters.skipped += to_take;
+        }
+        set_fast_forward(false);
+        return { .code = 0, .from = 0 };
+    }
+
+    // While fast forwarding, mGBA samples audio less often. blip_buf still
+    // gets the same number of cycles, so positions stay sample-accurate, but
+    // the samples (which get thrown away anyway) are of lower quality. The
+    // interval is a multiple of the normal one, so samples taken afterwards
+    // fall on the same cycles as they would have without fast forwarding.
+    void set_fast_forward(bool enabled)
+    {
+        if (enabled == fast_forwarding)
+            return;
+        auto *audio = &board()->audio;
+        fast_forwarding = enabled;
+        audio->sampleInterval = enabled ? FAST_SEEK_SAMPLE_INTERVAL
+                                        : 0x200 >> ((audio->soundbias >> 14) & 3);
+    }
+
+    // Emulates until new samples are available, either buffered or written to
+    // the destination set in `av`, taking snapshots on the way. Also stops
+    // once the emulator's clock reaches `deadline`, if there's one.
+    void fill(std::optional<u64> deadline = std::nullopt)
+    {
+        trace::Scope scope{GSF_TRACE_EMULATE};
+        auto start_cycles = mTimingGlobalTime(core->timing);
+        auto start_frame  = core->frameCounter(core);
+        while (av.read == 0 && av.written == 0) {
+            if (deadline && mTimingGlobalTime(core->timing) >= *deadline)
+                break;
+            if (snapshot_interval > 0 && num_samples >= next_snapshot())
+                save_snapshot();
+            core->runLoop(core);
+        }
+        counters.cycles += mTimingGlobalTime(core->timing) - start_cycles;
+        counters.frames += u32(core->frameCounter(core) - start_frame);
+    }
+
+    long next_snapshot() const
+    {
+        return snapshots.empty() ? snapshot_interval : snapshots.back().position + snapshot_interval;
+    }
+
+    // Snapshots taken while fast seeking have lower quality samples buffered,
+    // so they're only used for fast seeks and only if there's enough room
+    // after them to get back to full quality.
+    const Snapshot *find_snapshot(long position) const
+    {
+        auto it = std::upper_bound(snapshots.begin(), snapshots.end(), position,
+            [](long pos, const Snapshot &s) { return pos < s.position; });
+        while (it != snapshots.begin()) {
+            --it;
+            if (it->exact || (fast_seek && position - it->position >= FAST_SEEK_MARGIN * num_channels()))
+                return &*it;
+        }
+        return nullptr;
+    }
+
+    void save_snapshot()
+    {
+        trace::Scope scope{GSF_TRACE_SNAPSHOT};
+        auto snapshot = take_snapshot();
+        if (!snapshot)
+            return;
+        snapshot_bytes += snapshot->data.size();
+        snapshots.push_back(std::move(*snapshot));
+        trim_snapshots();
+    }
+
+    // Snapshots are only taken when no samples are buffered, so that the
+    // position is exactly the one of the emulator.
+    std::optional<Snapshot> take_snapshot()
+    {
+        auto *audio = &board()->audio;
+        auto *left  = core->getAudioChannel(core, 0);
+        auto *right = core->getAudioChannel(core, 1);
+        auto extra = AudioState {
+            .last_left  = audio->lastLeft,
+            .last_right = audio->lastRight,
+            .clock      = audio->clock,
+            .left_size  = static_cast<u32>(gsf_blip_used_size(left)),
+            .right_size = static_cast<u32>(gsf_blip_used_size(right)),
+            .stems_last = stems.last,
+            .stems_size = {},
+            .resampler_size = flags & GSF_RESAMPLER_SINC ? static_cast<u32>(resampler.state_size()) : 0,
+        };
+        std::size_t stems_size = 0;
+        if (multi()) {
+            for (auto i = 0; i < NUM_MULTI_CHANNELS; i++) {
+                extra.stems_size[i] = static_cast<u32>(gsf_blip_used_size(stems.blips[i]));
+                stems_size += extra.stems_size[i];
+            }
+        }
+        auto state_size = core->stateSize(core);
+        state_buf.resize(sizeof(AudioState) + state_size + extra.left_size + extra.right_size
+                       + stems_size + extra.resampler_size);
+        auto *p = state_buf.data();
+        std::memcpy(p, &extra, sizeof(AudioState));
+        p += sizeof(AudioState);
+        if (!core->saveState(core, p))
+            return std::nullopt;
+        p += state_size;
+        gsf_blip_save(left,  p, extra.left_size);
+        p += extra.left_size;
+        gsf_blip_save(right, p, extra.right_size);
+        p += extra.right_size;
+        if (multi()) {
+            for (auto i = 0; i < NUM_MULTI_CHANNELS; i++) {
+                gsf_blip_save(stems.blips[i], p, extra.stems_size[i]);
+                p += extra.stems_size[i];
+            }
+        }
+        if (flags & GSF_RESAMPLER_SINC)
+            resampler.save(p);
+        // savestates are mostly empty memory, so they compress very well
+        unsigned long size = compressBound(state_buf.size());
+        auto data = Vector<u8>(size, 0, GsfAllocator<u8>(allocators));
+        if (compress2(data.data(), &size, state_buf.data(), state_buf.size(), Z_BEST_SPEED) != Z_OK)
+            return std::nullopt;
+        data.resize(size);
+        data.shrink_to_fit();
+        return Snapshot { num_samples, state_buf.size(), std::move(data), !fast_forwarding };
+    }
+
+    // Emulates the whole file once from the start, taking a snapshot at the
+    // start and then about every `interval` samples, at the first point
+    // after it where nothing is buffered. Another emulator with the same file
+    // loaded can then render from each snapshot to the next one on its own,
+    // and gets the same samples.
+    // This doesn't fast forward: blip_buf's integrator rounds, so samples
+    // taken less often can leave it off by a fraction of a sample for good,
+    // which is enough to change a few samples by one. What can be skipped
+    // without changing any state is, though: the resampler's filtering.
+    Result<Vector<Snapshot>> capture_segments(long interval)
+    {
+        auto result = Vector<Snapshot>(GsfAllocator<Snapshot>(allocators));
+        auto was_fast = std::exchange(fast_seek, false);
+        reset();
+        num_samples = 0;
+        av.read = 0;
+        av.discard = true;
+        for (auto end = end_samples(); ; ) {
+            auto snapshot = take_snapshot();
+            if (!snapshot) {
+                fast_seek = was_fast;
+                av.discard = false;
+                return tl::unexpected(make_err(GSF_ALLOCATION_FAILED));
+            }
+            result.push_back(std::move(*snapshot));
+            if (num_samples + interval >= end)
+                break;
+            skip(interval);
+            num_samples += av.read;
+            av.clear(av.read);
+            if (num_samples >= end)
+                break;
+        }
+        fast_seek = was_fast;
+        av.discard = false;
+        return result;
+    }
+
+    bool load_snapshot(const Snapshot &snapshot)
+    {
+        state_buf.resize(snapshot.size);
+        unsigned long size = snapshot.size;
+        if (uncompress(state_buf.data(), &size, snapshot.data.data(), snapshot.data.size()) != Z_OK
+         || size != snapshot.size)
+            return false;
+        auto *p = state_buf.data();
+        AudioState extra;
+        std::memcpy(&extra, p, sizeof(AudioState));
+        p += sizeof(AudioState);
+        std::size_t stems_size = 0;
+        if (multi())
+            for (auto s : extra.stems_size)
+                stems_size += s;
+        auto state_size = snapshot.size - sizeof(AudioState) - extra.left_size - extra.right_size
+                        - stems_size - extra.resampler_size;
+        if (!core->loadState(core, p))
+            return false;
+        p += state_size;
+        auto *audio = &board()->audio;
+        audio->lastLeft  = extra.last_left;
+        audio->lastRight = extra.last_right;
+        audio->clock     = extra.clock;
+        gsf_blip_load(core->getAudioChannel(core, 0), p, extra.left_size);
+        p += extra.left_size;
+        gsf_blip_load(core->getAudioChannel(core, 1), p, extra.right_size);
+        p += extra.right_size;
+        if (multi()) {
+            for (auto i = 0; i < NUM_MULTI_CHANNELS; i++) {
+                gsf_blip_load(stems.blips[i], p, extra.stems_size[i]);
+                p += extra.stems_size[i];
+            }
+            stems.last = extra.stems_last;
+            stems.schedule(core->timing);
         }
-        core->setAVStream(core, &emu->av);
-        return emu;
+        if (flags & GSF_RESAMPLER_SINC)
+            resampler.load(p);
+        num_samples = snapshot.position;
+        av.read = 0;
+        return true;
     }
 
-    ~GsfEmu()
+    // When over the memory limit, keep only every other snapshot and double
+    // the interval, so that snapshots stay evenly spaced.
+    void trim_snapshots()
     {
-        core->deinit(core);
-        core = nullptr;
+        while (snapshot_bytes > snapshot_max_bytes && !snapshots.empty()) {
+            auto out = snapshots.begin();
+            for (auto i = 0u; i < snapshots.size(); i++) {
+                if (i % 2 == 1)
+                    *out++ = std::move(snapshots[i]);
+                else
+                    snapshot_bytes -= snapshots[i].data.size();
+            }
+            snapshots.erase(out, snapshots.end());
+            snapshot_interval *= 2;
+        }
     }
 
-    int load(std::span<u8> data, TagMap &&tags)
+    void set_snapshots(long interval, std::size_t max_bytes)
     {
-        if (!(flags & GSF_INFO_ONLY)) {
-            auto *vmem = VFileMemChunk(data.data(), data.size());
-            core->loadROM(core, vmem);
-            core->reset(core);
+        snapshot_interval = millis_to_samples(interval, samplerate, num_channels());
+        snapshot_base_interval = snapshot_interval;
+        snapshot_max_bytes = max_bytes;
+        if (snapshot_interval == 0) {
+            snapshots.clear();
+            snapshot_bytes = 0;
         }
-        this->tags = std::move(tags);
-        auto length_tag = get_tag("length").value_or("");
-        auto length = length_tag == "" ? default_len : parse_duration(length_tag).value_or(-1);
-        max_samples = millis_to_samples(length, samplerate, num_channels());
-        loaded = true;
-        return 0;
+        trim_snapshots();
     }
 
-    void play(short *out, long size)
+    void set_fast_seek(bool enabled) { fast_seek = enabled; }
+
+    void mute_channel(int channel, bool mute)
     {
-        if (flags & GSF_INFO_ONLY)
+        if (channel < 0 || channel >= NUM_VOICES)
             return;
-        memset(out, 0, size * sizeof(short));
-        for (auto took = 0; took < size && !ended(); ) {
-            while (av.read == 0)
-                core->runLoop(core);
-            auto to_take = std::min(size - took, av.read);
-            av.take(std::span<short>{ out + took, static_cast<size_t>(to_take) });
-            took += to_take;
-            num_samples += to_take;
-        }
+        muted = mute ? muted | 1u << channel : muted & ~(1u << channel);
+        apply_channel_mask();
     }
 
-    GsfError skip(long n)
+    void solo_channel(int channel, bool solo)
     {
-        if (flags & GSF_INFO_ONLY)
-            return { .code = 0, .from = 0 };
-        if (num_samples + n < 0 || (!infinite && num_samples + n > max_samples))
-            return make_err(GSF_SEEK_OUT_OF_BOUNDS);
-        if (n < 0) {
-            core->reset(core);
-            n = num_samples + n;
-            num_samples = 0;
-            av.read = 0;
-        }
-        for (auto took = 0; took < n && !ended(); ) {
-            while (av.read == 0)
-                core->runLoop(core);
-            auto to_take = std::min(n - took, av.read);
-            av.clear(to_take);
-            took += to_take;
-            num_samples += to_take;
+        if (channel < 0 || channel >= NUM_VOICES)
+            return;
+        soloed = solo ? soloed | 1u << channel : soloed & ~(1u << channel);
+        apply_channel_mask();
+    }
+
+    // A channel plays when it isn't muted and, if any channel is soloed,
+    // it's one of them. Muted channels are silent in stems too.
+    void apply_channel_mask()
+    {
+        if (!core)
+            return;
+        for (auto i = 0; i < NUM_VOICES; i++) {
+            bool enabled = !(muted & 1u << i) && (!soloed || soloed & 1u << i);
+            core->enableAudioChannel(core, i, enabled);
         }
-        return { .code = 0, .from = 0 };
     }
 
     std::optional<std::string_view> get_tag(const String &s) const
@@ -477,16 +2137,69 @@ public:
         }
     }
 
+    // Overrides the length of the loaded file, until the next one is loaded.
+    void set_length(long length)
+    {
+        max_samples = millis_to_samples(length, samplerate, num_channels());
+    }
+
     void set_infinite(bool value) { infinite = value; }
+    void set_fade(GsfFade value) { fade = value; }
+    void set_tag_volume(bool enabled) { use_tag_volume = enabled; }
+
+    // Where playback ends: after the fade, if there's one.
+    long end_samples() const
+    {
+        return max_samples < 0 || fade == GSF_FADE_NONE ? max_samples
+             : max_samples + fade_samples;
+    }
+
+    // The output stage for what gets played next, if it changes anything.
+    std::optional<Envelope> output_envelope() const
+    {
+        auto envelope = Envelope {
+            .volume      = use_tag_volume ? tag_volume : 1.0f,
+            // infinite playback never fades out
+            .fade        = infinite ? GSF_FADE_NONE : fade,
+            .fade_start  = max_samples / num_channels(),
+            .fade_frames = fade_samples / num_channels(),
+        };
+        if (envelope.volume == 1.0f && envelope.fade == GSF_FADE_NONE)
+            return std::nullopt;
+        return envelope;
+    }
+
+    void set_load_stats(const trace::LoadStats &stats) { load_stats = stats; }
+
+    void get_stats(GsfStats *out) const
+    {
+        auto ms = [&] (GsfTracePhase phase) {
+            return std::chrono::duration<double, std::milli>(load_stats.time[phase]).count();
+        };
+        *out = GsfStats {
+            .bytes_read      = load_stats.bytes_read,
+            .bytes_inflated  = load_stats.bytes_inflated,
+            .read_ms         = ms(GSF_TRACE_READ),
+            .parse_ms        = ms(GSF_TRACE_PARSE),
+            .inflate_ms      = ms(GSF_TRACE_INFLATE),
+            .impose_ms       = ms(GSF_TRACE_IMPOSE),
+            .setup_ms        = ms(GSF_TRACE_SETUP),
+            .cycles          = counters.cycles,
+            .frames          = counters.frames,
+            .samples_played  = counters.played,
+            .samples_skipped = counters.skipped,
+        };
+    }
 
     long tell()           const { return num_samples; }
     int sample_rate()     const { return samplerate; }
     long length_samples() const { return max_samples; }
     long default_length() const { return default_len; }
     bool is_infinite()    const { return infinite; }
-    bool ended()          const { return !infinite && num_samples >= max_samples; }
+    bool ended()          const { return !infinite && num_samples >= end_samples(); }
     bool loaded_file()    const { return loaded; }
-    int num_channels()    const { return NUM_CHANNELS; }
+    bool info_only()      const { return flags & GSF_INFO_ONLY; }
+    int num_channels()    const { return channels_for(flags); }
 };
 
 
@@ -501,8 +2214,101 @@ struct EmptyLogger : mLogger {
 
 
 
+/* emulator pools */
+
+class GsfEmuPool {
+    int sample_rate;
+    int flags;
+    std::size_t size;
+    GsfAllocators allocators;
+    std::mutex mutex;
+    Vector<GsfEmu *> idle;
+
+public:
+    GsfEmuPool(int sample_rate, int flags, std::size_t size, const GsfAllocators &allocators)
+        : sample_rate{sample_rate}, flags{flags}, size{size}, allocators{allocators},
+          idle(GsfAllocator<GsfEmu *>(allocators))
+    { }
+
+    ~GsfEmuPool()
+    {
+        for (auto *emu : idle)
+            gsf_delete_with_allocators(emu, &allocators);
+    }
+
+    GsfError fill()
+    {
+        idle.reserve(size);
+        while (idle.size() < size) {
+            GsfEmu *emu;
+            if (auto err = gsf_new_with_allocators(&emu, sample_rate, flags, &allocators); err.code != 0)
+                return err;
+            idle.push_back(emu);
+        }
+        return { .code = 0, .from = 0 };
+    }
+
+    GsfError acquire(GsfEmu **out)
+    {
+        {
+            auto lock = std::lock_guard(mutex);
+            if (!idle.empty()) {
+                *out = idle.back();
+                idle.pop_back();
+                return { .code = 0, .from = 0 };
+            }
+        }
+        // creating a core takes a while, so don't hold the lock for it
+        return gsf_new_with_allocators(out, sample_rate, flags, &allocators);
+    }
+
+    void release(GsfEmu *emu)
+    {
+        emu->unload();
+        emu->reset_settings();
+        {
+            auto lock = std::lock_guard(mutex);
+            if (idle.size() < size) {
+                idle.push_back(emu);
+                return;
+            }
+        }
+        gsf_delete_with_allocators(emu, &allocators);
+    }
+
+    const GsfAllocators &get_allocators() const { return allocators; }
+};
+
+
+
+/* batch rendering */
+
+#include "batch.hpp"
+
+
+
+/* real-time playback */
+
+#include "player.hpp"
+
+
+
 /* public API functions */
 
+GSF_API GsfReader gsf_stdio_reader(void)
+{
+    return stdio_reader;
+}
+
+GSF_API GsfReader gsf_mmap_reader(void)
+{
+#ifdef GSF_USE_MMAP
+    return mmap_reader;
+#else
+    return stdio_reader;
+#endif
+}
+
 GSF_API unsigned int gsf_get_version(void)
 {
     return GSF_VERSION;
@@ -522,11 +2328,15 @@ GSF_API GsfError gsf_new(GsfEmu **out, int sample_rate, int flags)
 
 GSF_API GsfError gsf_new_with_allocators(GsfEmu **out, int sample_rate, int flags, GsfAllocators *allocators)
 {
+    // mGBA's default logger is a global; with DISABLE_THREADING, every core
+    // reads it on each log call, so it must only be set once, before any
+    // core exists
+    static std::once_flag logger_flag;
+    std::call_once(logger_flag, [] { mLogSetDefaultLogger(&empty_logger); });
     auto emu = GsfEmu::create(sample_rate, flags, *allocators);
     if (!emu)
         return emu.error();
     *out = emu.value();
-    mLogSetDefaultLogger(&empty_logger);
     return { .code = 0, .from = 0 };
 }
 
@@ -538,12 +2348,18 @@ GSF_API void gsf_delete(GsfEmu *emu)
 
 GSF_API void gsf_delete_with_allocators(GsfEmu *emu, GsfAllocators *allocators)
 {
+    emu->~GsfEmu();
     allocators->free(emu, sizeof(GsfEmu), allocators->userdata);
 }
 
+GSF_API void gsf_unload(GsfEmu *emu)
+{
+    emu->unload();
+}
+
 GSF_API GsfError gsf_load_file(GsfEmu *emu, const char *filename)
 {
-    auto reader = GsfReader { default_read_file, default_delete_data, nullptr };
+    auto reader = default_reader();
     return gsf_load_file_with_reader(emu, filename, &reader);
 }
 
@@ -557,20 +2373,144 @@ GSF_API GsfError gsf_load_file_with_reader(GsfEmu *emu, const char *filename,
 GSF_API GsfError gsf_load_file_with_allocators(GsfEmu *emu,
     const char *filename, GsfAllocators *allocators)
 {
-    auto reader = GsfReader { default_read_file, default_delete_data, nullptr };
+    auto reader = default_reader();
     return gsf_load_file_with_reader_allocators(emu, filename, &reader, allocators);
 }
 
 GSF_API GsfError gsf_load_file_with_reader_allocators(GsfEmu *emu,
     const char *filename, GsfReader *reader, GsfAllocators *allocators)
 {
-    auto f = load_file(fs::path{filename}, *reader, *allocators);
+    auto range_reader = with_range(*reader);
+    return gsf_load_file_with_range_reader_allocators(emu, filename, &range_reader, allocators);
+}
+
+GSF_API GsfError gsf_load_file_with_range_reader(GsfEmu *emu, const char *filename,
+    GsfRangeReader *reader)
+{
+    auto alloc = GsfAllocators { detail::malloc, detail::free, nullptr };
+    return gsf_load_file_with_range_reader_allocators(emu, filename, reader, &alloc);
+}
+
+GSF_API GsfError gsf_load_file_with_range_reader_allocators(GsfEmu *emu,
+    const char *filename, GsfRangeReader *reader, GsfAllocators *allocators)
+{
+    auto collect = trace::Collect{};
+    auto f = load_file(fs::path{filename}, *reader, *allocators, emu->info_only());
+    if (!f)
+        return f.error();
+    emu->load(std::move(f.value().rom.data), std::move(f.value().tags));
+    emu->set_load_stats(collect.get());
+    return { .code = 0, .from = 0 };
+}
+
+GSF_API GsfError gsf_load_memory(GsfEmu *emu, GsfBuffer file, const GsfLibResolver *resolver)
+{
+    auto alloc = GsfAllocators { detail::malloc, detail::free, nullptr };
+    return gsf_load_memory_with_allocators(emu, file, resolver, &alloc);
+}
+
+GSF_API GsfError gsf_load_memory_with_allocators(GsfEmu *emu, GsfBuffer file,
+    const GsfLibResolver *resolver, GsfAllocators *allocators)
+{
+    auto collect = trace::Collect{};
+    auto f = load_memory(file, resolver, *allocators, emu->info_only());
     if (!f)
         return f.error();
-    emu->load(f.value().rom.data, std::move(f.value().tags));
+    emu->load(std::move(f.value().rom.data), std::move(f.value().tags));
+    emu->set_load_stats(collect.get());
+    return { .code = 0, .from = 0 };
+}
+
+GSF_API void gsf_get_stats(const GsfEmu *emu, GsfStats *out)
+{
+    emu->get_stats(out);
+}
+
+GSF_API bool gsf_set_trace_hooks(const GsfTraceHooks *hooks)
+{
+#ifdef GSF_TRACE
+    trace::hooks = hooks ? *hooks : GsfTraceHooks { nullptr, nullptr, nullptr };
+    return true;
+#else
+    (void) hooks;
+    return false;
+#endif
+}
+
+GSF_API void gsf_set_idle_loop_override(const char *game_code, long address)
+{
+    if (!game_code)
+        return;
+    auto code = std::array<char, 4>{};
+    std::copy_n(game_code, std::min<std::size_t>(std::strlen(game_code), 4), code.begin());
+    idle_loop_overrides.set(code, address < 0 ? IDLE_LOOP_NONE : u32(address));
+}
+
+GSF_API void gsf_clear_idle_loop_overrides(void)
+{
+    idle_loop_overrides.clear();
+}
+
+GSF_API bool gsf_get_idle_loop(const GsfEmu *emu, unsigned long *address)
+{
+    auto loop = emu->idle_loop();
+    if (loop && address)
+        *address = loop.value();
+    return loop.has_value();
+}
+
+GSF_API void gsf_set_lib_cache_size(size_t max_bytes)
+{
+    lib_cache.set_max_bytes(max_bytes);
+}
+
+GSF_API void gsf_clear_lib_cache(void)
+{
+    lib_cache.clear();
+}
+
+GSF_API bool gsf_set_rom_cache_dir(const char *path, size_t max_bytes)
+{
+    return rom_cache.set_dir(path, max_bytes);
+}
+
+GSF_API GsfError gsf_pool_new(GsfEmuPool **out, int sample_rate, int flags, size_t size)
+{
+    auto alloc = GsfAllocators { detail::malloc, detail::free, nullptr };
+    return gsf_pool_new_with_allocators(out, sample_rate, flags, size, &alloc);
+}
+
+GSF_API GsfError gsf_pool_new_with_allocators(GsfEmuPool **out, int sample_rate, int flags, size_t size,
+    GsfAllocators *allocators)
+{
+    auto *pool = allocate<GsfEmuPool>(*allocators, 1, sample_rate, flags, size, *allocators);
+    if (!pool)
+        return make_err(GSF_ALLOCATION_FAILED);
+    if (auto err = pool->fill(); err.code != 0) {
+        gsf_pool_delete(pool);
+        return err;
+    }
+    *out = pool;
     return { .code = 0, .from = 0 };
 }
 
+GSF_API void gsf_pool_delete(GsfEmuPool *pool)
+{
+    auto allocators = pool->get_allocators();
+    pool->~GsfEmuPool();
+    allocators.free(pool, sizeof(GsfEmuPool), allocators.userdata);
+}
+
+GSF_API GsfError gsf_pool_acquire(GsfEmuPool *pool, GsfEmu **out)
+{
+    return pool->acquire(out);
+}
+
+GSF_API void gsf_pool_release(GsfEmuPool *pool, GsfEmu *emu)
+{
+    pool->release(emu);
+}
+
 GSF_API bool gsf_loaded(const GsfEmu *emu)
 {
     return emu->loaded_file();
@@ -578,7 +2518,94 @@ GSF_API bool gsf_loaded(const GsfEmu *emu)
 
 GSF_API void gsf_play(GsfEmu *emu, short *out, long size)
 {
-    emu->play(out, size);
+    emu->play(Output { .format = Output::Format::S16, .data = out }, size);
+}
+
+GSF_API long gsf_play_budgeted(GsfEmu *emu, short *out, long size, long cycles)
+{
+    return emu->play_budgeted(Output { .format = Output::Format::S16, .data = out }, size, cycles);
+}
+
+GSF_API long gsf_play_cost(const GsfEmu *emu, long size)
+{
+    return emu->play_cost(size);
+}
+
+GSF_API GsfError gsf_player_new(GsfPlayer **out, GsfEmu *emu, const GsfPlayerOptions *options)
+{
+    auto alloc = GsfAllocators { detail::malloc, detail::free, nullptr };
+    return gsf_player_new_with_allocators(out, emu, options, &alloc);
+}
+
+GSF_API GsfError gsf_player_new_with_allocators(GsfPlayer **out, GsfEmu *emu,
+    const GsfPlayerOptions *options, GsfAllocators *allocators)
+{
+    auto player = GsfPlayer::create(emu, options, *allocators);
+    if (!player)
+        return player.error();
+    *out = player.value();
+    return { .code = 0, .from = 0 };
+}
+
+GSF_API void gsf_player_delete(GsfPlayer *player)
+{
+    auto allocators = player->get_allocators();
+    player->~GsfPlayer();
+    allocators.free(player, sizeof(GsfPlayer), allocators.userdata);
+}
+
+GSF_API long gsf_player_read(GsfPlayer *player, short *out, long size)
+{
+    return player->read(out, size);
+}
+
+GSF_API void gsf_player_seek(GsfPlayer *player, long millis)
+{
+    auto *emu = player->get_emu();
+    player->request_seek(millis_to_samples(millis, emu->sample_rate(), emu->num_channels()));
+}
+
+GSF_API void gsf_player_seek_samples(GsfPlayer *player, long samples)
+{
+    player->request_seek(samples);
+}
+
+GSF_API long gsf_player_tell(const GsfPlayer *player)
+{
+    auto *emu = player->get_emu();
+    return samples_to_millis(player->tell(), emu->sample_rate(), emu->num_channels());
+}
+
+GSF_API long gsf_player_tell_samples(const GsfPlayer *player)
+{
+    return player->tell();
+}
+
+GSF_API bool gsf_player_ended(const GsfPlayer *player)
+{
+    return player->ended();
+}
+
+GSF_API void gsf_player_get_stats(const GsfPlayer *player, GsfPlayerStats *out)
+{
+    player->get_stats(out);
+}
+
+GSF_API void gsf_play_f32(GsfEmu *emu, float *out, long size)
+{
+    emu->play(Output { .format = Output::Format::F32, .data = out }, size);
+}
+
+GSF_API void gsf_play_planar_f32(GsfEmu *emu, float *const *out, long frames)
+{
+    emu->play(Output { .format = Output::Format::F32_PLANAR, .data = (void *) out },
+              frames * emu->num_channels());
+}
+
+GSF_API void gsf_play_mono_f32(GsfEmu *emu, float *out, long frames)
+{
+    emu->play(Output { .format = Output::Format::F32_MONO, .data = out },
+              frames * emu->num_channels());
 }
 
 GSF_API bool gsf_ended(const GsfEmu *emu)
@@ -653,6 +2680,16 @@ GSF_API GsfError gsf_seek_samples(GsfEmu *emu, long samples)
     return emu->skip(samples - emu->tell());
 }
 
+GSF_API void gsf_set_seek_snapshots(GsfEmu *emu, long interval, size_t max_bytes)
+{
+    emu->set_snapshots(interval, max_bytes);
+}
+
+GSF_API void gsf_set_fast_seek(GsfEmu *emu, bool enabled)
+{
+    emu->set_fast_seek(enabled);
+}
+
 GSF_API void gsf_set_default_length(GsfEmu *emu, long length)
 {
     emu->set_default_length(length);
@@ -673,6 +2710,16 @@ GSF_API void gsf_set_infinite(GsfEmu *emu, bool infinite)
     emu->set_infinite(infinite);
 }
 
+GSF_API void gsf_set_fade(GsfEmu *emu, GsfFade fade)
+{
+    emu->set_fade(fade);
+}
+
+GSF_API void gsf_set_tag_volume(GsfEmu *emu, bool enabled)
+{
+    emu->set_tag_volume(enabled);
+}
+
 GSF_API int gsf_sample_rate(GsfEmu *emu)
 {
     return emu->sample_rate();
@@ -682,3 +2729,69 @@ GSF_API int gsf_num_channels(GsfEmu *emu)
 {
     return emu->num_channels();
 }
+
+GSF_API void gsf_mute_channel(GsfEmu *emu, int channel, bool mute)
+{
+    emu->mute_channel(channel, mute);
+}
+
+GSF_API void gsf_solo_channel(GsfEmu *emu, int channel, bool solo)
+{
+    emu->solo_channel(channel, solo);
+}
+
+GSF_API GsfError gsf_render(GsfRenderJob *jobs, size_t count, const GsfRenderOptions *options)
+{
+    auto alloc = GsfAllocators { detail::malloc, detail::free, nullptr };
+    return gsf_render_with_allocators(jobs, count, options, &alloc);
+}
+
+GSF_API GsfError gsf_render_with_allocators(GsfRenderJob *jobs, size_t count,
+    const GsfRenderOptions *options, GsfAllocators *allocators)
+{
+    auto threads = options->threads > 0 ? options->threads : pool::default_threads();
+    auto workers = RenderWorkers(threads, allocators);
+    auto first_error = GsfError { .code = 0, .from = 0 };
+    std::mutex error_mutex;
+
+    pool::run(count, threads, [&](int index, std::size_t i) {
+        auto &worker = workers[index];
+        auto &job = jobs[i];
+        job.samples = 0;
+        job.error = worker.create(*options, allocators);
+        if (job.error.code != 0) {
+            auto lock = std::lock_guard(error_mutex);
+            if (first_error.code == 0)
+                first_error = job.error;
+        } else
+            job.error = render_file(worker, job, *options, allocators);
+        if (job.done)
+            job.done(&job, job.userdata);
+    });
+    return first_error;
+}
+
+GSF_API GsfError gsf_render_segmented(GsfRenderJob *job, const GsfRenderOptions *options,
+    long segment_length, int *mismatches)
+{
+    auto alloc = GsfAllocators { detail::malloc, detail::free, nullptr };
+    return gsf_render_segmented_with_allocators(job, options, segment_length, mismatches, &alloc);
+}
+
+GSF_API GsfError gsf_render_segmented_with_allocators(GsfRenderJob *job, const GsfRenderOptions *options,
+    long segment_length, int *mismatches, GsfAllocators *allocators)
+{
+    auto threads = options->threads > 0 ? options->threads : pool::default_threads();
+    auto workers = RenderWorkers(threads, allocators);
+    job->samples = 0;
+    if (mismatches)
+        *mismatches = 0;
+    // the first pass only costs less than a render when it can skip the sinc filter
+    if (options->flags != GSF_RESAMPLER_SINC)
+        job->error = make_err(GSF_INVALID_ARGUMENT);
+    else
+        job->error = render_segments(workers, threads, *job, *options, segment_length, mismatches, allocators);
+    if (job->done)
+        job->done(job, job->userdata);
+    return job->error;
+}
@@ -0,0 +1,224 @@
+#pragma once
+
+/*
+ * Real-time playback: GsfPlayer, behind the gsf_player_* functions. This
+ * builds on GsfEmu and the rest of gsf.cpp, which includes it right after
+ * them; it isn't meant to be included anywhere else.
+ */
+
+#include "gsf.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <thread>
+
+// Plays an emulator on a thread of its own into a ring buffer, which a
+// single other thread reads from. Only the producer thread touches the
+// emulator and only the reader moves the read position, so reading takes no
+// locks and never allocates. Seeks are requests for the producer, which
+// then tells the reader where the samples from the new position start.
+class GsfPlayer {
+    static constexpr long DEFAULT_LATENCY = 8192;
+
+    GsfEmu *emu;
+    GsfAllocators allocators;
+    int channels;
+    long chunk;             // samples rendered at a time
+    Vector<short> ring;
+
+    // positions in the ring count samples since the start, and only grow.
+    // Each side polls the other's, so they're kept on separate cache lines
+    // with padding: players live in memory from the user's allocators,
+    // which is only aligned like malloc's, so aligning them wouldn't hold
+    static constexpr std::size_t CACHE_LINE = 64;
+    std::atomic<u64> write_pos = 0;
+    [[maybe_unused]] char write_pad[CACHE_LINE];
+    std::atomic<u64> read_pos  = 0;
+    [[maybe_unused]] char read_pad[CACHE_LINE];
+
+    // where the samples after the last seek start in the ring and in the
+    // track. A seqlock: `restart_seq` is odd while they're being changed.
+    std::atomic<u32> restart_seq = 0;
+    std::atomic<u64> restart_at = 0;
+    std::atomic<long> restart_sample = 0;
+
+    // reader side only, except for `position`
+    u32 seen_restart = 0;
+    u64 base_at = 0;
+    long base_sample = 0;
+    std::atomic<long> position = 0;
+
+    std::atomic<u32> seek_requests = 0;
+    std::atomic<long> seek_target = 0;
+    std::atomic<bool> stopping = false;
+    std::atomic<bool> finished = false;
+    std::atomic<int> wake = 0;
+
+    std::atomic<unsigned long> underruns = 0;
+    std::atomic<unsigned long> underrun_samples = 0;
+    std::atomic<unsigned long> dropped_samples = 0;
+
+    std::thread thread;
+
+    u64 capacity() const { return ring.size(); }
+
+    void notify()
+    {
+        wake.fetch_add(1, std::memory_order_release);
+        wake.notify_one();
+    }
+
+    void run()
+    {
+        u32 handled = 0;
+        while (true) {
+            auto seen = wake.load(std::memory_order_acquire);
+            if (stopping.load(std::memory_order_acquire))
+                return;
+            if (auto seq = seek_requests.load(std::memory_order_acquire); seq != handled) {
+                handled = seq;
+                seek(seek_target.load(std::memory_order_relaxed));
+                continue;
+            }
+            auto w = write_pos.load(std::memory_order_relaxed);
+            auto room = capacity() - (w - read_pos.load(std::memory_order_acquire));
+            if (finished.load(std::memory_order_relaxed) || room < u64(chunk)) {
+                wake.wait(seen, std::memory_order_acquire);
+                continue;
+            }
+            // render straight into the ring, in two goes if it wraps around
+            auto start = emu->tell();
+            auto at = w % capacity();
+            auto first = std::min<u64>(chunk, capacity() - at);
+            emu->play(Output { .format = Output::Format::S16, .data = &ring[at] }, first);
+            if (first < u64(chunk))
+                emu->play(Output { .format = Output::Format::S16, .data = ring.data() }, chunk - first);
+            // what's past the end is padding, so leave it out
+            auto made = std::min<u64>(chunk, emu->tell() - start);
+            write_pos.store(w + made, std::memory_order_release);
+            // an emulator that can't go any further would otherwise be asked again forever
+            if (emu->ended() || made == 0)
+                finished.store(true, std::memory_order_release);
+        }
+    }
+
+    void seek(long target)
+    {
+        if (emu->skip(target - emu->tell()).code != 0)
+            return;
+        auto seq = restart_seq.load(std::memory_order_relaxed);
+        restart_seq.store(seq + 1, std::memory_order_relaxed);
+        // released so that the odd count is seen before them
+        restart_at.store(write_pos.load(std::memory_order_relaxed), std::memory_order_release);
+        restart_sample.store(emu->tell(), std::memory_order_release);
+        restart_seq.store(seq + 2, std::memory_order_release);
+        finished.store(emu->ended(), std::memory_order_release);
+    }
+
+    // Skips what was buffered before the last seek, if the reader hasn't yet.
+    void catch_up()
+    {
+        auto seq = restart_seq.load(std::memory_order_acquire);
+        if (seq == seen_restart || seq % 2 != 0)
+            return;
+        auto at = restart_at.load(std::memory_order_acquire);
+        auto sample = restart_sample.load(std::memory_order_acquire);
+        // changed while reading: try again next time
+        if (restart_seq.load(std::memory_order_relaxed) != seq)
+            return;
+        seen_restart = seq;
+        base_at = at;
+        base_sample = sample;
+        // samples after the restart may have been read already
+        auto r = read_pos.load(std::memory_order_relaxed);
+        if (r < at) {
+            dropped_samples.fetch_add(at - r, std::memory_order_relaxed);
+            read_pos.store(at, std::memory_order_release);
+        }
+    }
+
+public:
+    GsfPlayer(GsfEmu *emu, long latency, long chunk, const GsfAllocators &allocators)
+        : emu{emu}, allocators{allocators}, channels{emu->num_channels()},
+          chunk{chunk * channels}, ring(latency * channels, 0, GsfAllocator<short>(allocators))
+    {
+        base_sample = emu->tell();
+        position = base_sample;
+        finished = emu->ended();
+    }
+
+    ~GsfPlayer()
+    {
+        stopping.store(true, std::memory_order_release);
+        notify();
+        if (thread.joinable())
+            thread.join();
+    }
+
+    static Result<GsfPlayer *> create(GsfEmu *emu, const GsfPlayerOptions *options,
+        const GsfAllocators &allocators)
+    {
+        if (emu->info_only() || !emu->loaded_file())
+            return tl::unexpected(make_err(GSF_INVALID_ARGUMENT));
+        auto latency = options && options->latency > 0 ? options->latency : DEFAULT_LATENCY;
+        auto chunk   = options && options->chunk   > 0 ? std::min(options->chunk, latency)
+                                                       : std::max(latency / 4, 1L);
+        auto *player = allocate<GsfPlayer>(allocators, 1, emu, latency, chunk, allocators);
+        if (!player)
+            return tl::unexpected(make_err(GSF_ALLOCATION_FAILED));
+        player->thread = std::thread([player] { player->run(); });
+        return player;
+    }
+
+    long read(short *out, long size)
+    {
+        catch_up();
+        auto r = read_pos.load(std::memory_order_relaxed);
+        auto w = write_pos.load(std::memory_order_acquire);
+        auto n = std::min<u64>(std::max(size, 0L), w - r);
+        auto at = r % capacity();
+        auto first = std::min<u64>(n, capacity() - at);
+        std::copy_n(&ring[at], first, out);
+        std::copy_n(ring.data(), n - first, out + first);
+        read_pos.store(r + n, std::memory_order_release);
+        position.store(base_sample + long(r + n - base_at), std::memory_order_relaxed);
+        if (long(n) < size) {
+            std::fill(out + n, out + size, 0);
+            // running out at the end isn't an underrun
+            if (!finished.load(std::memory_order_acquire) || write_pos.load(std::memory_order_acquire) != r + n) {
+                underruns.fetch_add(1, std::memory_order_relaxed);
+                underrun_samples.fetch_add(size - n, std::memory_order_relaxed);
+            }
+        }
+        if (capacity() - (w - r - n) >= u64(chunk))
+            notify();
+        return n;
+    }
+
+    void request_seek(long samples)
+    {
+        seek_target.store(samples, std::memory_order_relaxed);
+        seek_requests.fetch_add(1, std::memory_order_release);
+        notify();
+    }
+
+    long tell() const { return position.load(std::memory_order_relaxed); }
+
+    bool ended() const
+    {
+        return finished.load(std::memory_order_acquire)
+            && read_pos.load(std::memory_order_acquire) == write_pos.load(std::memory_order_acquire);
+    }
+
+    void get_stats(GsfPlayerStats *out) const
+    {
+        out->underruns        = underruns.load(std::memory_order_relaxed);
+        out->underrun_samples = underrun_samples.load(std::memory_order_relaxed);
+        out->dropped_samples  = dropped_samples.load(std::memory_order_relaxed);
+        out->buffered = long(write_pos.load(std::memory_order_acquire) - read_pos.load(std::memory_order_acquire));
+    }
+
+    GsfEmu *get_emu() const { return emu; }
+    const GsfAllocators &get_allocators() const { return allocators; }
+};
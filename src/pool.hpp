@@ -0,0 +1,91 @@
+#pragma once
+
+#include <algorithm>
+#include <cstddef>
+#include <deque>
+#include <mutex>
+#include <optional>
+#include <thread>
+#include <vector>
+
+namespace pool {
+
+/* The number of threads to use when none is asked for: one per core. */
+inline int default_threads()
+{
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+/*
+ * How indices are first handed out to workers. CONTIGUOUS gives each worker
+ * its own range, which keeps neighbouring items (often sharing libraries) on
+ * the same worker. ROUND_ROBIN deals them like cards, and has workers steal
+ * the earliest items instead of the latest, so that items finish roughly in
+ * order, for callers that have to consume results in order.
+ */
+enum class Deal { CONTIGUOUS, ROUND_ROBIN };
+
+/*
+ * Calls fn(worker, index) for each index in [0, count) on `threads` threads,
+ * returning once all are done. `worker` is in [0, threads) and stays the same
+ * for every call made by a thread, so that callers can keep state per worker.
+ * Each worker takes indices from the front of its own queue; once it runs
+ * out, it steals from the others (from the back, unless dealt round-robin),
+ * which evens out items of very different lengths.
+ * The calling thread is one of the workers.
+ */
+template <typename F>
+void run(std::size_t count, int threads, F &&fn, Deal deal = Deal::CONTIGUOUS)
+{
+    if (count == 0)
+        return;
+    threads = static_cast<int>(std::clamp<std::size_t>(threads < 1 ? default_threads() : threads, 1, count));
+    struct Queue {
+        std::mutex mutex;
+        std::deque<std::size_t> items;
+    };
+    auto queues = std::vector<Queue>(threads);
+    for (std::size_t i = 0; i < count; i++)
+        queues[deal == Deal::CONTIGUOUS ? i * threads / count : i % threads].items.push_back(i);
+
+    auto next = [&](int worker) -> std::optional<std::size_t> {
+        {
+            auto &q = queues[worker];
+            auto lock = std::lock_guard(q.mutex);
+            if (!q.items.empty()) {
+                auto i = q.items.front();
+                q.items.pop_front();
+                return i;
+            }
+        }
+        // nothing is ever added once started, so when there's nothing left
+        // to steal, this worker is done
+        for (int k = 1; k < threads; k++) {
+            auto &q = queues[(worker + k) % threads];
+            auto lock = std::lock_guard(q.mutex);
+            if (!q.items.empty() && deal == Deal::ROUND_ROBIN) {
+                auto i = q.items.front();
+                q.items.pop_front();
+                return i;
+            } else if (!q.items.empty()) {
+                auto i = q.items.back();
+                q.items.pop_back();
+                return i;
+            }
+        }
+        return std::nullopt;
+    };
+
+    auto work = [&](int worker) {
+        while (auto i = next(worker))
+            fn(worker, *i);
+    };
+    auto workers = std::vector<std::thread>{};
+    for (int w = 1; w < threads; w++)
+        workers.emplace_back(work, w);
+    work(0);
+    for (auto &t : workers)
+        t.join();
+}
+
+} // namespace pool
@@ -0,0 +1,225 @@
+/*
+ * Renders GSF files to WAV files, many at a time, using gsf_render.
+ * Run without arguments to see the options.
+ */
+
+#include "gsf.h"
+
+#include <algorithm>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <bit>
+#include <chrono>
+#include <filesystem>
+#include <mutex>
+#include <string>
+#include <vector>
+
+namespace fs = std::filesystem;
+
+using Clock = std::chrono::steady_clock;
+
+struct Settings {
+    int rate = 44100;
+    int channels = 2;
+};
+
+// One output file. It's only opened once the first samples come in, so that
+// there are never more files open than threads.
+struct Track {
+    const Settings *settings;
+    std::string input;
+    std::string output;
+    FILE *file = nullptr;
+    bool failed = false;
+};
+
+std::mutex print_mutex;
+
+void put_le(FILE *f, unsigned long value, int bytes)
+{
+    for (int i = 0; i < bytes; i++)
+        std::fputc((value >> (i * 8)) & 0xFF, f);
+}
+
+// The sizes are filled in by finish once they're known.
+void write_wav_header(FILE *f, int rate, int channels, unsigned long data_size)
+{
+    std::fwrite("RIFF", 1, 4, f);
+    put_le(f, 36 + data_size, 4);
+    std::fwrite("WAVEfmt ", 1, 8, f);
+    put_le(f, 16, 4);
+    put_le(f, 1, 2);                        // PCM
+    put_le(f, channels, 2);
+    put_le(f, rate, 4);
+    put_le(f, rate * channels * 2, 4);      // bytes per second
+    put_le(f, channels * 2, 2);             // bytes per frame
+    put_le(f, 16, 2);                       // bits per sample
+    std::fwrite("data", 1, 4, f);
+    put_le(f, data_size, 4);
+}
+
+bool open_wav(Track &track)
+{
+    track.file = std::fopen(track.output.c_str(), "wb");
+    if (!track.file) {
+        track.failed = true;
+        return false;
+    }
+    write_wav_header(track.file, track.settings->rate, track.settings->channels, 0);
+    return true;
+}
+
+bool write_samples(const short *samples, long size, void *userdata)
+{
+    auto &track = *static_cast<Track *>(userdata);
+    if (!track.file && !open_wav(track))
+        return false;
+    if constexpr (std::endian::native == std::endian::little) {
+        if (std::fwrite(samples, sizeof(short), size, track.file) != std::size_t(size)) {
+            track.failed = true;
+            return false;
+        }
+    } else {
+        for (long i = 0; i < size; i++)
+            put_le(track.file, static_cast<unsigned short>(samples[i]), 2);
+    }
+    return true;
+}
+
+void finish(const GsfRenderJob *job, void *userdata)
+{
+    auto &track = *static_cast<Track *>(userdata);
+    if (job->error.code == 0 && !track.file && !track.failed)
+        open_wav(track);
+    if (track.file) {
+        std::fseek(track.file, 0, SEEK_SET);
+        write_wav_header(track.file, track.settings->rate, track.settings->channels,
+                         static_cast<unsigned long>(job->samples) * 2);
+        track.failed |= std::fclose(track.file) != 0;
+        track.file = nullptr;
+    }
+    auto lock = std::lock_guard(print_mutex);
+    if (job->error.code != 0)
+        std::fprintf(stderr, "%s: couldn't load file (error %d, %d)\n",
+            track.input.c_str(), job->error.code, job->error.from);
+    else if (track.failed)
+        std::fprintf(stderr, "%s: couldn't write %s\n", track.input.c_str(), track.output.c_str());
+    else
+        std::printf("%s -> %s (%.1f s)\n", track.input.c_str(), track.output.c_str(),
+            double(job->samples) / track.settings->channels / track.settings->rate);
+}
+
+void usage()
+{
+    std::fprintf(stderr,
+        "usage: gsf-render [options] <files...>\n"
+        "options:\n"
+        "  -j <threads>  number of threads (default: one per core)\n"
+        "  -o <dir>      where to write the WAV files (default: next to each file)\n"
+        "  -r <rate>     sample rate (default: 44100)\n"
+        "  -l <millis>   length of files without a length tag (default: 180000)\n"
+        "  -t <millis>   render every file for this long, ignoring length tags\n"
+        "  -p <millis>   render one file at a time, split into segments this long\n"
+        "                rendered in parallel (0: pick a length); needs -s\n"
+        "  -s            resample with the windowed-sinc resampler\n"
+        "  -n            render at the native rate of 32768 Hz\n"
+        "  -f            fade out at the end, as given by the fade tag\n"
+        "  -v            apply the volume tag\n");
+}
+
+int main(int argc, char *argv[])
+{
+    auto options = GsfRenderOptions {
+        .sample_rate    = 44100,
+        .flags          = 0,
+        .threads        = 0,
+        .default_length = 180000,
+        .length         = 0,
+        .fade           = GSF_FADE_NONE,
+        .tag_volume     = false,
+    };
+    const char *outdir = nullptr;
+    long segment_length = -1;
+    int i = 1;
+    for (; i < argc && argv[i][0] == '-' && argv[i][1] != '\0'; i++) {
+        auto needs_value = std::strchr("jorltp", argv[i][1]) != nullptr;
+        if (needs_value && i + 1 == argc) {
+            usage();
+            return 1;
+        }
+        switch (argv[i][1]) {
+        case 'j': options.threads = std::atoi(argv[++i]); break;
+        case 'o': outdir = argv[++i]; break;
+        case 'r': options.sample_rate = std::atoi(argv[++i]); break;
+        case 'l': options.default_length = std::atol(argv[++i]); break;
+        case 't': options.length = std::atol(argv[++i]); break;
+        case 'p': segment_length = std::atol(argv[++i]); break;
+        case 's': options.flags |= GSF_RESAMPLER_SINC; break;
+        case 'n': options.flags |= GSF_RESAMPLER_NATIVE; break;
+        case 'f': options.fade = GSF_FADE_LOG; break;
+        case 'v': options.tag_volume = true; break;
+        default:
+            usage();
+            return 1;
+        }
+    }
+    if (i == argc || options.sample_rate <= 0) {
+        usage();
+        return 1;
+    }
+    if (segment_length >= 0 && options.flags != GSF_RESAMPLER_SINC) {
+        std::fprintf(stderr, "-p only works with -s, and without -n\n");
+        return 1;
+    }
+
+    auto settings = Settings {
+        .rate     = options.flags & GSF_RESAMPLER_NATIVE ? 32768 : options.sample_rate,
+        .channels = 2,
+    };
+    auto tracks = std::vector<Track>{};
+    for (; i < argc; i++) {
+        auto path = fs::path(argv[i]);
+        auto out = (outdir ? fs::path(outdir) / path.filename() : path).replace_extension(".wav");
+        tracks.push_back(Track { &settings, argv[i], out.string() });
+    }
+    auto outputs = std::vector<const Track *>{};
+    for (auto &track : tracks)
+        outputs.push_back(&track);
+    std::sort(outputs.begin(), outputs.end(), [](auto *a, auto *b) { return a->output < b->output; });
+    for (std::size_t j = 1; j < outputs.size(); j++) {
+        if (outputs[j]->output == outputs[j-1]->output) {
+            std::fprintf(stderr, "%s and %s would both be rendered to %s\n",
+                outputs[j-1]->input.c_str(), outputs[j]->input.c_str(), outputs[j]->output.c_str());
+            return 1;
+        }
+    }
+    auto jobs = std::vector<GsfRenderJob>{};
+    for (auto &track : tracks)
+        jobs.push_back(GsfRenderJob { track.input.c_str(), write_samples, finish, &track, {}, 0 });
+
+    auto start = Clock::now();
+    if (segment_length >= 0) {
+        // errors are reported by finish
+        for (auto &job : jobs) {
+            int mismatches = 0;
+            gsf_render_segmented(&job, &options, segment_length, &mismatches);
+            if (mismatches != 0)
+                std::fprintf(stderr, "%s: %d segments don't match the end of the one before them\n",
+                    job.filename, mismatches);
+        }
+    } else if (auto err = gsf_render(jobs.data(), jobs.size(), &options); err.code != 0)
+        std::fprintf(stderr, "couldn't create emulator (error %d, %d)\n", err.code, err.from);
+    auto wall = std::chrono::duration<double>(Clock::now() - start).count();
+
+    double emulated = 0;
+    int failed = 0;
+    for (std::size_t j = 0; j < jobs.size(); j++) {
+        emulated += double(jobs[j].samples) / settings.channels / settings.rate;
+        failed += jobs[j].error.code != 0 || tracks[j].failed;
+    }
+    std::printf("rendered %zu files, %.1f s of audio in %.2f s: %.1f emulated seconds per second\n",
+        jobs.size() - failed, emulated, wall, wall > 0 ? emulated / wall : 0.0);
+    return failed ? 1 : 0;
+}
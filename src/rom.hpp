@@ -0,0 +1,431 @@
+#pragma once
+
+/*
+ * Rom storage: SharedRom, RomImage and the on-disk RomCache. This builds on
+ * the types at the top of gsf.cpp, which includes it before parsing files;
+ * it isn't meant to be included anywhere else.
+ */
+
+#include "gsf.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <filesystem>
+#include <memory>
+#include <mutex>
+#include <optional>
+#include <random>
+#include <set>
+#include <span>
+#include <tuple>
+#include <utility>
+#include <vector>
+#include <zlib.h>
+#ifdef GSF_SHARE_ROMS
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+#include "allocation.hpp"
+
+constexpr u32 ROM_MASK = 0x01FFFFFF;
+
+struct ProgramHeader {
+    u32 entry_point;
+    u32 offset;
+    u32 size;
+};
+
+#ifdef GSF_SHARE_ROMS
+
+// Rom data kept in an anonymous memory file, so that emulators can map it
+// copy-on-write instead of copying it: emulators playing files of the same
+// library then share its pages, and only own the ones their files patch.
+class SharedRom {
+    int fd = -1;
+    const u8 *view = nullptr;
+    std::size_t length = 0;
+
+public:
+    SharedRom() = default;
+    SharedRom(const SharedRom &) = delete;
+    SharedRom & operator=(const SharedRom &) = delete;
+
+    ~SharedRom()
+    {
+        if (view)
+            munmap(const_cast<u8 *>(view), length);
+        if (fd != -1)
+            close(fd);
+    }
+
+    static std::shared_ptr<const SharedRom> create(std::span<const u8> data)
+    {
+        if (data.empty())
+            return nullptr;
+        auto rom = std::make_shared<SharedRom>();
+        rom->fd = memfd_create("gsf rom", MFD_CLOEXEC);
+        if (rom->fd == -1 || ftruncate(rom->fd, data.size()) != 0)
+            return nullptr;
+        auto *p = mmap(nullptr, data.size(), PROT_READ | PROT_WRITE, MAP_SHARED, rom->fd, 0);
+        if (p == MAP_FAILED)
+            return nullptr;
+        std::copy(data.begin(), data.end(), static_cast<u8 *>(p));
+        rom->view = static_cast<const u8 *>(p);
+        rom->length = data.size();
+        return rom;
+    }
+
+    // Maps `size` bytes of a file, read-only, so that every process mapping
+    // the same file shares its pages. Takes ownership of `file`.
+    static std::shared_ptr<const SharedRom> open(int file, std::size_t size)
+    {
+        auto rom = std::make_shared<SharedRom>();
+        rom->fd = file;
+        auto *p = mmap(nullptr, size, PROT_READ, MAP_SHARED, rom->fd, 0);
+        if (size == 0 || p == MAP_FAILED)
+            return nullptr;
+        rom->view = static_cast<const u8 *>(p);
+        rom->length = size;
+        return rom;
+    }
+
+    std::span<const u8> bytes() const { return { view, length }; }
+    int file() const { return fd; }
+};
+
+#else
+
+// Without support for sharing roms, libraries are always copied.
+class SharedRom {
+public:
+    std::span<const u8> bytes() const { return {}; }
+    static std::shared_ptr<const SharedRom> create(std::span<const u8>) { return nullptr; }
+};
+
+#endif
+
+// A rom image, being built or being played. Its memory is normally its own,
+// but an image can instead start as a copy-on-write mapping of a SharedRom,
+// in which case the whole address range a rom can use is reserved up front,
+// and pages only take memory once written. Images only grow.
+class RomImage {
+    Vector<u8> own;
+    u8 *mapped = nullptr;
+    std::size_t mapped_size = 0;
+
+    static constexpr std::size_t MAX_SIZE = std::size_t(ROM_MASK) + 1;
+
+    void unmap()
+    {
+#ifdef GSF_SHARE_ROMS
+        if (mapped)
+            munmap(mapped, MAX_SIZE);
+#endif
+        mapped = nullptr;
+        mapped_size = 0;
+    }
+
+public:
+    explicit RomImage(const GsfAllocators &allocators) : own(GsfAllocator<u8>(allocators)) { }
+    RomImage(const RomImage &) = delete;
+    RomImage & operator=(const RomImage &) = delete;
+
+    RomImage(RomImage &&other) noexcept
+        : own{std::move(other.own)},
+          mapped{std::exchange(other.mapped, nullptr)},
+          mapped_size{std::exchange(other.mapped_size, 0)}
+    { }
+
+    RomImage & operator=(RomImage &&other) noexcept
+    {
+        unmap();
+        own = std::move(other.own);
+        mapped = std::exchange(other.mapped, nullptr);
+        mapped_size = std::exchange(other.mapped_size, 0);
+        return *this;
+    }
+
+    ~RomImage() { unmap(); }
+
+    // Starts an empty image with `rom` mapped at `start`. Fails, leaving the
+    // image empty, if mappings aren't supported or `start` isn't at a page
+    // boundary. The mapping stays valid once `rom` is gone.
+    bool map(const SharedRom &rom, std::size_t start)
+    {
+#ifdef GSF_SHARE_ROMS
+        auto page = std::size_t(sysconf(_SC_PAGESIZE));
+        auto bytes = rom.bytes();
+        if (!own.empty() || mapped || bytes.empty() || start % page != 0 || start + bytes.size() > MAX_SIZE)
+            return false;
+        auto *p = mmap(nullptr, MAX_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (p == MAP_FAILED)
+            return false;
+        mapped = static_cast<u8 *>(p);
+        if (mmap(mapped + start, bytes.size(), PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_FIXED,
+                 rom.file(), 0) == MAP_FAILED) {
+            unmap();
+            return false;
+        }
+        mapped_size = start + bytes.size();
+        return true;
+#else
+        (void) rom;
+        (void) start;
+        return false;
+#endif
+    }
+
+    u8 *data()             { return mapped ? mapped : own.data(); }
+    const u8 *data() const { return mapped ? mapped : own.data(); }
+    std::size_t size() const { return mapped ? mapped_size : own.size(); }
+    bool empty() const { return size() == 0; }
+    u8 &operator[](std::size_t i) { return data()[i]; }
+    const u8 &operator[](std::size_t i) const { return data()[i]; }
+
+    void resize(std::size_t size)
+    {
+        if (!mapped)
+            own.resize(size);
+        else if (size > mapped_size)
+            mapped_size = std::min(size, MAX_SIZE);
+    }
+
+    void shrink_to_fit() { own.shrink_to_fit(); }
+    std::span<const u8> bytes() const { return { data(), size() }; }
+};
+
+#ifdef GSF_SHARE_ROMS
+
+// Uncompressed libraries can also be kept on disk, in a directory shared by
+// every process, so that each library is uncompressed once rather than once
+// per process. Files are named after the CRC and the size of the compressed
+// program and are mapped read-only, so processes playing the same library
+// share its pages through the page cache. Files are written under a temporary
+// name and renamed once complete, so that nobody sees one half-written. Once
+// the directory gets too big, the least recently used files are deleted,
+// which is safe even if other processes still have them mapped. Each file
+// also records the CRC of the rom itself, which every process checks the
+// first time it uses the file, deleting it if it doesn't match.
+class RomCache {
+    // at the end of each file, so that the rom itself starts at offset 0, and
+    // on a page of its own: the rest of the rom's last page is mapped too,
+    // and must read as zeros, as it does for roms that aren't cached
+    struct Trailer {
+        char magic[8];
+        u32 crc;
+        u32 program_size;
+        u32 entry_point;
+        u32 offset;
+        u32 rom_crc;
+        u32 reserved; // zero
+        u64 size;
+        u64 id; // random, so that a new file reusing the inode of a deleted one is told apart
+    };
+
+    static constexpr char MAGIC[8] = { 'G', 'S', 'F', 'R', 'O', 'M', '0', '3' };
+    static constexpr auto STALE_TEMP_AGE = std::chrono::hours(1);
+
+    std::mutex mutex;
+    fs::path dir;
+    std::size_t max_bytes = 0;
+    // files whose rom this process has checked, by device, inode, size and
+    // id: files are only ever renamed into place, never written to, and
+    // their modification time changes whenever they're used
+    using FileKey = std::tuple<dev_t, ino_t, off_t, u64>;
+    std::set<FileKey> checked;
+
+    std::optional<std::pair<fs::path, std::size_t>> config()
+    {
+        std::lock_guard lock{mutex};
+        if (dir.empty())
+            return std::nullopt;
+        return std::pair{dir, max_bytes};
+    }
+
+    static fs::path path_for(const fs::path &dir, u32 crc, std::size_t program_size)
+    {
+        char name[32];
+        std::snprintf(name, sizeof(name), "%08x-%08zx.rom", crc, program_size);
+        return dir / name;
+    }
+
+    static u32 crc_of(std::span<const u8> rom) { return crc32(crc32(0l, nullptr, 0), rom.data(), rom.size()); }
+
+    static std::size_t padded(std::size_t rom_size)
+    {
+        auto page = std::size_t(sysconf(_SC_PAGESIZE));
+        return (rom_size + page - 1) / page * page;
+    }
+
+    bool was_checked(const FileKey &key)
+    {
+        std::lock_guard lock{mutex};
+        return checked.contains(key);
+    }
+
+    void set_checked(const FileKey &key)
+    {
+        std::lock_guard lock{mutex};
+        checked.insert(key);
+    }
+
+    static bool write_all(int fd, const void *data, std::size_t size)
+    {
+        for (auto *p = static_cast<const u8 *>(data); size > 0; ) {
+            auto n = write(fd, p, size);
+            if (n < 0 && errno == EINTR)
+                continue;
+            if (n <= 0)
+                return false;
+            p += n;
+            size -= n;
+        }
+        return true;
+    }
+
+    // Deletes the least recently used files until the directory fits in
+    // `max`, along with temporary files left behind by crashed processes.
+    static void evict(const fs::path &dir, std::size_t max)
+    {
+        struct File {
+            fs::path path;
+            fs::file_time_type time;
+            std::uintmax_t size;
+        };
+        std::error_code ec;
+        auto files = std::vector<File>{};
+        std::uintmax_t total = 0;
+        auto now = fs::file_time_type::clock::now();
+        for (const auto &entry : fs::directory_iterator(dir, ec)) {
+            auto name = entry.path().filename().string();
+            auto time = entry.last_write_time(ec);
+            auto size = ec ? 0 : entry.file_size(ec);
+            if (ec)
+                continue;
+            if (entry.path().extension() == ".rom") {
+                files.push_back(File { entry.path(), time, size });
+                total += size;
+            } else if (name.find(".rom.") != name.npos && now - time > STALE_TEMP_AGE)
+                fs::remove(entry.path(), ec);
+        }
+        std::sort(files.begin(), files.end(), [](const File &a, const File &b) { return a.time < b.time; });
+        for (const auto &f : files) {
+            if (total <= max)
+                break;
+            if (fs::remove(f.path, ec))
+                total -= f.size;
+        }
+    }
+
+public:
+    bool enabled() { return config().has_value(); }
+
+    // Finds the rom of a program, filling in its header.
+    std::shared_ptr<const SharedRom> find(u32 crc, std::size_t program_size, ProgramHeader &header)
+    {
+        auto conf = config();
+        if (!conf)
+            return nullptr;
+        auto path = path_for(conf->first, crc, program_size);
+        int fd = ::open(path.c_str(), O_RDONLY | O_CLOEXEC);
+        if (fd == -1)
+            return nullptr;
+        struct stat st;
+        auto t = Trailer{};
+        if (fstat(fd, &st) != 0 || std::size_t(st.st_size) < sizeof(t)
+         || pread(fd, &t, sizeof(t), st.st_size - sizeof(t)) != sizeof(t)
+         || std::memcmp(t.magic, MAGIC, sizeof(MAGIC)) != 0
+         || t.crc != crc || t.program_size != program_size
+         || t.size == 0 || t.size > ROM_MASK + 1 || padded(t.size) + sizeof(t) != u64(st.st_size)) {
+            close(fd);
+            return nullptr;
+        }
+        auto rom = SharedRom::open(fd, t.size);
+        if (!rom)
+            return nullptr;
+        auto key = FileKey { st.st_dev, st.st_ino, st.st_size, t.id };
+        if (!was_checked(key)) {
+            if (crc_of(rom->bytes()) != t.rom_crc) {
+                // only delete it if it hasn't been replaced in the meantime
+                struct stat now;
+                if (stat(path.c_str(), &now) == 0 && now.st_dev == st.st_dev && now.st_ino == st.st_ino)
+                    unlink(path.c_str());
+                return nullptr;
+            }
+            set_checked(key);
+        }
+        // marks it as recently used; fails harmlessly on files of other users
+        futimens(fd, nullptr);
+        header = ProgramHeader { t.entry_point, t.offset, u32(t.size) };
+        return rom;
+    }
+
+    // Stores the rom of a program and maps the stored file.
+    std::shared_ptr<const SharedRom> store(u32 crc, std::size_t program_size, const ProgramHeader &header,
+        std::span<const u8> rom)
+    {
+        auto conf = config();
+        if (!conf || rom.empty() || padded(rom.size()) + sizeof(Trailer) > conf->second)
+            return nullptr;
+        auto path = path_for(conf->first, crc, program_size);
+        auto temp = path.string() + ".XXXXXX";
+        int fd = mkostemp(temp.data(), O_CLOEXEC);
+        if (fd == -1)
+            return nullptr;
+        auto random = std::random_device{};
+        auto id = u64(random()) << 32 | random();
+        auto t = Trailer { {}, crc, u32(program_size), header.entry_point, header.offset, crc_of(rom), 0,
+                           rom.size(), id };
+        std::memcpy(t.magic, MAGIC, sizeof(MAGIC));
+        struct stat st;
+        // the gap between the rom and the trailer is left as a hole, which reads as zeros
+        if (fchmod(fd, 0644) != 0 || !write_all(fd, rom.data(), rom.size())
+         || lseek(fd, padded(rom.size()), SEEK_SET) == -1 || !write_all(fd, &t, sizeof(t))
+         || fstat(fd, &st) != 0 || rename(temp.c_str(), path.c_str()) != 0) {
+            unlink(temp.c_str());
+            close(fd);
+            return nullptr;
+        }
+        // written from memory, so there's nothing to check
+        set_checked(FileKey { st.st_dev, st.st_ino, st.st_size, id });
+        evict(conf->first, conf->second);
+        return SharedRom::open(fd, rom.size());
+    }
+
+    bool set_dir(const char *path, std::size_t max)
+    {
+        std::error_code ec;
+        if (path)
+            fs::create_directories(path, ec);
+        if (ec)
+            return false;
+        {
+            std::lock_guard lock{mutex};
+            dir = path ? fs::path(path) : fs::path{};
+            max_bytes = max;
+        }
+        if (path)
+            evict(path, max);
+        return true;
+    }
+};
+
+#else
+
+// Without support for sharing roms, there's no way to map cached files.
+class RomCache {
+public:
+    bool enabled() { return false; }
+    std::shared_ptr<const SharedRom> find(u32, std::size_t, ProgramHeader &) { return nullptr; }
+    std::shared_ptr<const SharedRom> store(u32, std::size_t, const ProgramHeader &, std::span<const u8>)
+    {
+        return nullptr;
+    }
+    bool set_dir(const char *, std::size_t) { return false; }
+};
+
+#endif
@@ -2,6 +2,7 @@
 
 #include <algorithm>
 #include <cstring>
+#include <cerrno>
 #include <charconv>
 #include <optional>
 #include <string>
@@ -98,6 +99,8 @@ template <typename T>
 std::from_chars_result from_chars_double(const char *first, const char *, double &value)
 {
     char *endptr;
+    // errno may be left over from anything that ran before
+    errno = 0;
     value = strtod(first, &endptr);
     std::from_chars_result res;
     res.ptr = endptr,
@@ -0,0 +1,97 @@
+#pragma once
+
+#include "gsf.h"
+
+#include <array>
+#include <chrono>
+#include <cstdint>
+
+namespace trace {
+
+#ifdef GSF_TRACE
+inline GsfTraceHooks hooks = { nullptr, nullptr, nullptr };
+#endif
+
+/*
+ * Calls the trace hooks at the beginning and end of its scope. Without
+ * GSF_TRACE it does nothing, and compiles to nothing.
+ */
+class Scope {
+#ifdef GSF_TRACE
+    GsfTracePhase phase;
+
+public:
+    explicit Scope(GsfTracePhase phase) : phase{phase}
+    {
+        if (hooks.begin)
+            hooks.begin(phase, hooks.userdata);
+    }
+
+    ~Scope()
+    {
+        if (hooks.end)
+            hooks.end(phase, hooks.userdata);
+    }
+#else
+public:
+    explicit Scope(GsfTracePhase) { }
+#endif
+
+    Scope(const Scope &) = delete;
+    Scope & operator=(const Scope &) = delete;
+};
+
+/* What loading a file took. */
+struct LoadStats {
+    std::uint64_t bytes_read = 0;
+    std::uint64_t bytes_inflated = 0;
+    std::array<std::chrono::nanoseconds, GSF_TRACE_PHASE_COUNT> time = {};
+};
+
+/*
+ * Where loading phases running on this thread are accounted, if anywhere.
+ * Loading goes through free functions that don't know the emulator they're
+ * loading for, so this is set for the duration of a load by Collect.
+ */
+inline thread_local LoadStats *current = nullptr;
+
+class Collect {
+    LoadStats stats;
+    LoadStats *outer;
+
+public:
+    Collect() : outer{current} { current = &stats; }
+    ~Collect() { current = outer; }
+    Collect(const Collect &) = delete;
+    Collect & operator=(const Collect &) = delete;
+
+    const LoadStats &get() const { return stats; }
+};
+
+inline void count_read(std::uint64_t bytes)     { if (current) current->bytes_read += bytes; }
+inline void count_inflated(std::uint64_t bytes) { if (current) current->bytes_inflated += bytes; }
+
+/* Like Scope, but also times the phase when loading stats are collected. */
+class Timed {
+    Scope scope;
+    LoadStats *stats;
+    GsfTracePhase phase;
+    std::chrono::steady_clock::time_point start;
+
+public:
+    explicit Timed(GsfTracePhase phase)
+        : scope{phase}, stats{current}, phase{phase},
+          start{stats ? std::chrono::steady_clock::now() : std::chrono::steady_clock::time_point{}}
+    { }
+
+    ~Timed()
+    {
+        if (stats)
+            stats->time[phase] += std::chrono::steady_clock::now() - start;
+    }
+
+    Timed(const Timed &) = delete;
+    Timed & operator=(const Timed &) = delete;
+};
+
+} // namespace trace